@@ -1,8 +1,23 @@
 #include "ruby.h"
+#include "ruby/thread.h"
+#include "ruby/util.h"
+#include <termios.h>
+#include <math.h>
 #include "serial_device.h"
+#include "serial_stream.h"
+#include "serial_reduce.h"
+#include "serial_discover.h"
+#include "serial_trace.h"
+#include "serial_control.h"
 
 
 VALUE cSerialDevice;
+VALUE cStream;
+VALUE cSubscriber;
+VALUE cControlLoop;
+
+// Started control loops, so one is not collected while it runs
+VALUE rsd_running_loops;
 
 VALUE DEVICE_SYMBOL;
 VALUE BAUDRATE_SYMBOL;
@@ -13,6 +28,111 @@ VALUE NONE_SYMBOL;
 VALUE ODD_SYMBOL;
 VALUE EVEN_SYMBOL;
 VALUE HARDWARE_FLOW_CONTROL_SYMBOL;
+VALUE DROP_SYMBOL;
+VALUE BLOCK_SYMBOL;
+VALUE COALESCE_SYMBOL;
+VALUE RECORD_LENGTH_SYMBOL;
+VALUE FIELDS_SYMBOL;
+VALUE DECIMATE_SYMBOL;
+VALUE RAW_SYMBOL;
+VALUE RECORDS_SYMBOL;
+VALUE STATS_SYMBOL;
+VALUE DECIMATED_SYMBOL;
+VALUE MEAN_SYMBOL;
+VALUE MIN_SYMBOL;
+VALUE MAX_SYMBOL;
+VALUE RMS_SYMBOL;
+VALUE PROBE_SYMBOL;
+VALUE IDENTITY_SYMBOL;
+VALUE INPUT_SYMBOL;
+VALUE OUTPUT_SYMBOL;
+VALUE FIELD_SYMBOL;
+VALUE KP_SYMBOL;
+VALUE KI_SYMBOL;
+VALUE KD_SYMBOL;
+VALUE SETPOINT_SYMBOL;
+VALUE INITIAL_SYMBOL;
+VALUE RATE_SYMBOL;
+VALUE ACK_SYMBOL;
+VALUE RESPONSE_TIMEOUT_SYMBOL;
+VALUE IDLE_SYMBOL;
+VALUE ITERATIONS_SYMBOL;
+VALUE OVERRUNS_SYMBOL;
+VALUE MISSES_SYMBOL;
+VALUE ERROR_SYMBOL;
+VALUE INTEGRAL_SYMBOL;
+VALUE CYCLE_TIME_SYMBOL;
+VALUE INTERVAL_SYMBOL;
+VALUE LAST_ERROR_SYMBOL;
+VALUE RESTORE_SYMBOL;
+
+// Settings parsed from a SerialDevice options hash
+typedef struct {
+  VALUE device_value;
+  char *device;
+  int baudrate;
+  int data_bits;
+  int stop_bits;
+  int parity;
+  int flow_control;
+  int restore;
+} RSD_OPTIONS_T;
+
+// Ruby side of a stream subscriber, sub is NULL once closed
+typedef struct {
+  SD_SUBSCRIBER sub;
+  volatile int cancel;
+  int readers;   /* threads inside sd_subscriber_read without the GVL */
+  int closing;   /* close was called while readers were still in there */
+} RSD_SUBSCRIBER_T;
+
+// Arguments for an acquisition made without the GVL
+typedef struct {
+  SERIAL_DEVICE sd;
+  int n_bytes;
+  SD_REDUCER reducer;
+  char *raw;
+  int result;
+} RSD_ACQUIRE_T;
+
+// Arguments for port discovery made without the GVL
+typedef struct {
+  char **devices;
+  int n_devices;
+  SD_PROBE_PROFILE *profiles;
+  int n_profiles;
+  int deadline_ms;
+  SD_PROBE_RESULT *results;
+  int result;
+  volatile int cancel;
+} RSD_DISCOVER_T;
+
+// Arguments for a subscriber read made without the GVL
+typedef struct {
+  RSD_SUBSCRIBER_T *rsub;
+  char *buf;
+  int n;
+  int timeout_ms;
+  int result;
+} RSD_SUBSCRIBER_READ_T;
+
+/**
+ * Device behind a SerialDevice, raising once it has been closed or
+ * while a running stream or control loop has claimed what the caller
+ * is about to do, SD_CLAIM_READ and/or SD_CLAIM_WRITE
+ */
+static SERIAL_DEVICE rsd_device(VALUE self, int what)
+{
+  SERIAL_DEVICE sd;
+  Data_Get_Struct(self, SERIAL_DEVICE_T, sd);
+  if (NULL == sd || 0 > sd->fd) {
+    rb_raise(rb_eException, sd_errstring(SERIAL_DEVICE_ERR_CLOSED));
+  }
+  if (0 != (sd->claimed & what)) {
+    rb_raise(rb_eException, sd_errstring(SERIAL_DEVICE_ERR_BUSY));
+  }
+  return sd;
+}
 
 /**
  * Write a message to the serial device and
@@ -21,8 +141,8 @@ VALUE HARDWARE_FLOW_CONTROL_SYMBOL;
 VALUE rsd_send_message(VALUE self, VALUE message)
 {
 	SERIAL_DEVICE sd;
-	Data_Get_Struct(self, SERIAL_DEVICE_T, sd);
-	int err = sd_send_message(sd, (string_t)STR2CSTR(message));
+	sd = rsd_device(self, SD_CLAIM_READ | SD_CLAIM_WRITE);
+	int err = sd_send_message(sd, StringValueCStr(message));
 	if ( SERIAL_DEVICE_OK == err) {
 		return rb_str_new2(sd->last_response);
 	} else {
@@ -36,7 +156,7 @@ VALUE rsd_send_message(VALUE self, VALUE message)
 VALUE rsd_read_nbytes(VALUE self, VALUE fixnum_bytes) 
 {
   SERIAL_DEVICE sd;
-  Data_Get_Struct(self, SERIAL_DEVICE_T, sd);
+  sd = rsd_device(self, SD_CLAIM_READ);
   
   int nbytes = NUM2INT(fixnum_bytes);
   unsigned char buf[nbytes];
@@ -44,7 +164,9 @@ VALUE rsd_read_nbytes(VALUE self, VALUE fixnum_bytes)
 
   nbytes = sd_read_nbytes(sd, nbytes, buf);
 
-  if (0 == nbytes) {
+  if (0 > nbytes) {
+    rb_raise(rb_eException, sd_errstring(SERIAL_DEVICE_ERR_READ));
+  } else if (0 == nbytes) {
     return Qnil;
   } else while (nbytes-- > 0) {
     rb_ary_unshift(array, INT2FIX(buf[nbytes]));
@@ -53,6 +175,91 @@ VALUE rsd_read_nbytes(VALUE self, VALUE fixnum_bytes)
   return array;
 }
 
+/* Bytes per packed stamp, see SerialDevice::STAMP_FORMAT */
+#define RSD_STAMP_SIZE 28
+#define RSD_MAX_STAMPS 64
+
+static void rsd_put_le(unsigned char *p, unsigned long long v, int size)
+{
+  int i;
+  for (i = 0; i < size; i++) {
+    p[i] = (unsigned char)(v >> (8 * i));
+  }
+}
+
+/**
+ * Pack stamps little-endian as STAMP_FORMAT, one record per chunk
+ */
+static VALUE rsd_pack_stamps(SD_CHUNK_STAMP *stamps, int n)
+{
+  VALUE packed = rb_str_new(NULL, (long)n * RSD_STAMP_SIZE);
+  unsigned char *p = (unsigned char *)RSTRING_PTR(packed);
+  int i;
+
+  for (i = 0; i < n; i++, p += RSD_STAMP_SIZE) {
+    rsd_put_le(p, stamps[i].ts_ns, 8);
+    rsd_put_le(p + 8, stamps[i].first_ns, 8);
+    rsd_put_le(p + 16, (unsigned int)stamps[i].offset, 4);
+    rsd_put_le(p + 20, (unsigned int)stamps[i].length, 4);
+    rsd_put_le(p + 24, (unsigned int)stamps[i].queued, 4);
+  }
+  return packed;
+}
+
+/**
+ * Like read_bytes but returns [data, stamp] with data as a String and
+ * the chunk's arrival packed as STAMP_FORMAT, or nil if nothing arrived.
+ */
+VALUE rsd_read_nbytes_stamped(VALUE self, VALUE fixnum_bytes)
+{
+  SERIAL_DEVICE sd;
+  SD_CHUNK_STAMP stamp;
+  VALUE data;
+  int nbytes;
+
+  sd = rsd_device(self, SD_CLAIM_READ);
+  nbytes = NUM2INT(fixnum_bytes);
+  data = rb_str_buf_new(nbytes);
+
+  nbytes = sd_read_nbytes_stamped(sd, nbytes, RSTRING_PTR(data), &stamp);
+  if (0 > nbytes) {
+    rb_raise(rb_eException, sd_errstring(SERIAL_DEVICE_ERR_READ));
+  } else if (0 == nbytes) {
+    return Qnil;
+  }
+  rb_str_set_len(data, nbytes);
+  return rb_assoc_new(data, rsd_pack_stamps(&stamp, 1));
+}
+
+/**
+ * Like read but returns [response, stamps], one STAMP_FORMAT record
+ * per read() chunk.  Offsets count raw bytes, before trimming.
+ */
+VALUE rsd_read_stamped(VALUE self)
+{
+  SERIAL_DEVICE sd;
+  SD_CHUNK_STAMP stamps[RSD_MAX_STAMPS];
+  int n_stamps;
+
+  sd = rsd_device(self, SD_CLAIM_READ);
+  int err = sd_read_stamped(sd, stamps, RSD_MAX_STAMPS, &n_stamps);
+  if ( SERIAL_DEVICE_OK == err ) {
+    return rb_assoc_new(rb_str_new2(sd->last_response), rsd_pack_stamps(stamps, n_stamps));
+  } else {
+    rb_raise(rb_eException, sd_errstring(err));
+  }
+}
+
+/**
+ * Nanoseconds per character on the wire, for back computing arrival times
+ */
+VALUE rsd_char_time_ns(VALUE self)
+{
+  SERIAL_DEVICE sd;
+  sd = rsd_device(self, 0);
+  return ULL2NUM(sd_char_time_ns(sd));
+}
+
 /**
  * Read bytes from the serial device.  
  * Number of bytes read is limited by serial_device.c
@@ -60,7 +267,7 @@ VALUE rsd_read_nbytes(VALUE self, VALUE fixnum_bytes)
 VALUE rsd_read(VALUE self)
 {
   SERIAL_DEVICE sd;
-  Data_Get_Struct(self, SERIAL_DEVICE_T, sd);
+  sd = rsd_device(self, SD_CLAIM_READ);
   int err = sd_read(sd);
   if ( SERIAL_DEVICE_OK == err ) {
     return rb_str_new2(sd->last_response);
@@ -76,8 +283,8 @@ VALUE rsd_read(VALUE self)
 VALUE rsd_write(VALUE self, VALUE string)
 {
   SERIAL_DEVICE sd;
-  Data_Get_Struct(self, SERIAL_DEVICE_T, sd);
-  int err = sd_write(sd, STR2CSTR(string));
+  sd = rsd_device(self, SD_CLAIM_WRITE);
+  int err = sd_write(sd, StringValueCStr(string));
   if ( SERIAL_DEVICE_OK == err ) {
     return Qnil;
   } else {
@@ -93,32 +300,44 @@ VALUE rsd_init(VALUE self, VALUE device)
 /**
  * Issue command to close the underlying file
  * Resources are not freed until it is garbage collected
+ * A shared device gives up this object's hold on it instead,
+ * the port closes once every holder has.
+ * Raises while a running stream is reading the device, stop it first.
  */
 VALUE rsd_close(VALUE self)
 {
   SERIAL_DEVICE sd;
+  int err = SERIAL_DEVICE_OK;
   Data_Get_Struct(self, SERIAL_DEVICE_T, sd);
-  sd_close(sd);
+  if (NULL != sd && sd->shared) {
+    DATA_PTR(self) = NULL;
+    sd_destroy(sd);
+  } else if (NULL != sd) {
+    err = sd_close(sd);
+  }
+  if ( SERIAL_DEVICE_OK != err ) {
+    rb_raise(rb_eException, sd_errstring(err));
+  }
 
   return Qnil;
 }
 
 /**
- * Create a new Serial Device.
- * Takes an options hash which must recognizes the following keys
+ * Parse the options hash for SerialDevice.new and open_shared.
+ * Recognizes the following keys
  *   :device,  required. 
  *   :baud,    default=9600
  *   :parity,  one of :none,:even,:odd. Default=:none
  *   :stop_bits, 1 or 2, default=1
  *   :data_bits, 5,6,7,8, default=8
  *   :hw_flow,   true or false default = false
+ *   :restore,   false to leave the port configured on close, default = true
  */
- VALUE rsd_new(VALUE sdClass,  VALUE options) 
+static void rsd_parse_options(VALUE options, RSD_OPTIONS_T *o)
 {
 
 	VALUE options_value;
 
-	VALUE argv[1];
 	char *device;
 	int baud_default = 9600;
 	VALUE parity_default = NONE_SYMBOL;
@@ -138,8 +357,8 @@ VALUE rsd_close(VALUE self)
 	  options_value = rb_hash_aref(options, DEVICE_SYMBOL);
 	  if (RTEST(options_value)) {
 	    Check_Type(options_value, T_STRING);
-	    argv[0] = options_value;
-	    device = STR2CSTR(options_value);
+	    o->device_value = options_value;
+	    device = StringValueCStr(options_value);
 	  } else {
 	    rb_raise(rb_eException, ":device must be specified");
 	  }
@@ -203,25 +422,47 @@ VALUE rsd_close(VALUE self)
 	  parity = SERIAL_DEVICE_PARITY_NONE;
 	} else if (parity_value == ODD_SYMBOL) {
 	  parity = SERIAL_DEVICE_PARITY_ODD;
-	} else if (parity == EVEN_SYMBOL) {
+	} else if (parity_value == EVEN_SYMBOL) {
 	  parity = SERIAL_DEVICE_PARITY_EVEN;
 	} else {
 	  rb_raise(rb_eException, "Parity must be :odd, :even, or :none");
 	}
 
+	o->device = device;
+	o->baudrate = baudrate;
+	o->data_bits = data_bits;
+	o->stop_bits = stop_bits;
+	o->parity = parity;
+	o->flow_control = flow_control;
+	o->restore = (Qfalse != rb_hash_aref(options, RESTORE_SYMBOL));
+}
+
+/**
+ * Create a new Serial Device.
+ * Takes an options hash, see rsd_parse_options
+ */
+ VALUE rsd_new(VALUE sdClass,  VALUE options) 
+{
+	RSD_OPTIONS_T o;
+	VALUE argv[1];
+
+	rsd_parse_options(options, &o);
+	argv[0] = o.device_value;
+
 	SERIAL_DEVICE sd = 
-	  sd_initWithDevice_baudrate_dataBits_stopBits_parity_flowControl(device, 
-							      baudrate, 
-							      data_bits, 
-							      stop_bits, 
-							      parity,
-							      flow_control);
+	  sd_initWithDevice_baudrate_dataBits_stopBits_parity_flowControl(o.device, 
+							      o.baudrate, 
+							      o.data_bits, 
+							      o.stop_bits, 
+							      o.parity,
+							      o.flow_control);
 	
 	if ( NULL == sd ) {
 		// Throw
 		rb_raise(rb_eException, "Error initializing device");
 		return Qnil;
 	} else {
+		sd_set_restore(sd, o.restore);
 		// Wrap pilot in a ruby object
 		// Pass in free routine for garbage collector
 		VALUE tdata = Data_Wrap_Struct(sdClass, 0, sd_destroy, sd); 
@@ -230,16 +471,799 @@ VALUE rsd_close(VALUE self)
 	}
 }
 
+/**
+ * Return a Serial Device sharing the process wide handle for the
+ * device, opening and configuring it only the first time.
+ * Takes the same options as new, which must match those the device
+ * is already shared with.  The port closes when the last user
+ * closes or drops it.  Any holder passing :restore => false leaves
+ * it configured then.
+ */
+VALUE rsd_open_shared(VALUE sdClass, VALUE options)
+{
+	RSD_OPTIONS_T o;
+	VALUE argv[1];
+	int err;
+
+	rsd_parse_options(options, &o);
+	argv[0] = o.device_value;
+
+	SERIAL_DEVICE sd = sd_open_shared(o.device, o.baudrate, o.data_bits,
+					  o.stop_bits, o.parity, o.flow_control, &err);
+	if ( NULL == sd ) {
+		rb_raise(rb_eException, SERIAL_DEVICE_ERR_SHARED == err ? sd_errstring(err) : "Error initializing device");
+	}
+	if (!o.restore) {
+		sd_set_restore(sd, 0);
+	}
+
+	VALUE tdata = Data_Wrap_Struct(sdClass, 0, sd_destroy, sd);
+	rb_obj_call_init(tdata, 1, argv);
+	return tdata;
+}
+
+static void *rsd_acquire_nogvl(void *arg)
+{
+  RSD_ACQUIRE_T *a = (RSD_ACQUIRE_T *)arg;
+  a->result = sd_acquire_reduced(a->sd, a->n_bytes, a->reducer, a->raw);
+  return NULL;
+}
+
+/**
+ * Read exactly nbytes of fixed length binary records and reduce
+ * big-endian u16 columns in c as they arrive.
+ * Takes an options hash which recognizes the following keys
+ *   :record_length, required.  Bytes per record
+ *   :fields,   hash of name => byte offset of a u16 column
+ *   :decimate, N to also return N:1 block averaged columns
+ *   :raw,      true to also return the full resolution bytes
+ * Returns a hash with :records, :stats => {name => {:mean, :min, :max, :rms}}
+ * and, when asked for, :decimated => {name => [...]} and :raw
+ */
+VALUE rsd_acquire(int argc, VALUE *argv, VALUE self)
+{
+  SERIAL_DEVICE sd;
+  RSD_ACQUIRE_T a;
+  VALUE nbytes, options, options_value, names, raw, result, stats, decimated, column;
+  int offsets[SD_REDUCE_MAX_FIELDS];
+  int record_length, decimate = 0, n_fields = 0;
+  int i, j;
+  double mean, rms;
+  unsigned int min, max;
+
+  sd = rsd_device(self, SD_CLAIM_READ);
+  rb_scan_args(argc, argv, "11", &nbytes, &options);
+  if (NIL_P(options)) {
+    options = rb_hash_new();
+  }
+  Check_Type(options, T_HASH);
+
+  options_value = rb_hash_aref(options, RECORD_LENGTH_SYMBOL);
+  if (RTEST(options_value)) {
+    record_length = NUM2INT(options_value);
+  } else {
+    rb_raise(rb_eException, ":record_length must be specified");
+  }
+
+  names = rb_ary_new();
+  options_value = rb_hash_aref(options, FIELDS_SYMBOL);
+  if (RTEST(options_value)) {
+    Check_Type(options_value, T_HASH);
+    names = rb_funcall(options_value, rb_intern("keys"), 0);
+    n_fields = RARRAY_LEN(names);
+    if (SD_REDUCE_MAX_FIELDS < n_fields) {
+      rb_raise(rb_eException, "At most %d fields can be reduced", SD_REDUCE_MAX_FIELDS);
+    }
+    for (i = 0; i < n_fields; i++) {
+      offsets[i] = NUM2INT(rb_hash_aref(options_value, rb_ary_entry(names, i)));
+    }
+  }
+
+  options_value = rb_hash_aref(options, DECIMATE_SYMBOL);
+  if (RTEST(options_value)) {
+    decimate = NUM2INT(options_value);
+  }
+
+  a.sd = sd;
+  a.n_bytes = NUM2INT(nbytes);
+  a.raw = NULL;
+  raw = Qnil;
+  if (RTEST(rb_hash_aref(options, RAW_SYMBOL))) {
+    raw = rb_str_buf_new(a.n_bytes);
+    a.raw = RSTRING_PTR(raw);
+  }
+
+  a.reducer = sd_reducer_new(record_length, decimate);
+  if (NULL == a.reducer) {
+    rb_raise(rb_eException, "Record length and decimation must be positive");
+  }
+  for (i = 0; i < n_fields; i++) {
+    if (0 > sd_reducer_add_field(a.reducer, offsets[i])) {
+      sd_reducer_free(a.reducer);
+      rb_raise(rb_eException, "Field offset %d does not fit in a record", offsets[i]);
+    }
+  }
+
+  rb_thread_call_without_gvl(rsd_acquire_nogvl, &a, NULL, NULL);
+  if ( SERIAL_DEVICE_OK != a.result ) {
+    sd_reducer_free(a.reducer);
+    rb_raise(rb_eException, sd_errstring(a.result));
+  }
+
+  result = rb_hash_new();
+  stats = rb_hash_new();
+  decimated = rb_hash_new();
+  rb_hash_aset(result, RECORDS_SYMBOL, ULL2NUM(a.reducer->records));
+  rb_hash_aset(result, STATS_SYMBOL, stats);
+  for (i = 0; i < n_fields; i++) {
+    sd_reducer_stats(a.reducer, i, &mean, &min, &max, &rms);
+    options_value = rb_hash_new();
+    rb_hash_aset(options_value, MEAN_SYMBOL, rb_float_new(mean));
+    rb_hash_aset(options_value, MIN_SYMBOL, UINT2NUM(min));
+    rb_hash_aset(options_value, MAX_SYMBOL, UINT2NUM(max));
+    rb_hash_aset(options_value, RMS_SYMBOL, rb_float_new(rms));
+    rb_hash_aset(stats, rb_ary_entry(names, i), options_value);
+
+    if (0 < decimate) {
+      column = rb_ary_new2(a.reducer->fields[i].n_decimated);
+      for (j = 0; j < a.reducer->fields[i].n_decimated; j++) {
+	rb_ary_push(column, rb_float_new(a.reducer->fields[i].decimated[j]));
+      }
+      rb_hash_aset(decimated, rb_ary_entry(names, i), column);
+    }
+  }
+  if (0 < decimate) {
+    rb_hash_aset(result, DECIMATED_SYMBOL, decimated);
+  }
+  if (!NIL_P(raw)) {
+    RB_GC_GUARD(raw);
+    rb_str_set_len(raw, a.n_bytes);
+    rb_hash_aset(result, RAW_SYMBOL, raw);
+  }
+  sd_reducer_free(a.reducer);
+
+  return result;
+}
+
+static void *rsd_probe_nogvl(void *arg)
+{
+  RSD_DISCOVER_T *d = (RSD_DISCOVER_T *)arg;
+  d->result = sd_discover(d->devices, d->n_devices, d->profiles, d->n_profiles,
+			  d->deadline_ms, d->results, &d->cancel);
+  return NULL;
+}
+
+/**
+ * Called by Ruby to interrupt discovery, every probe gives up
+ */
+static void rsd_probe_ubf(void *arg)
+{
+  ((RSD_DISCOVER_T *)arg)->cancel = 1;
+}
+
+/**
+ * Probe serial ports concurrently for the identity of what is attached.
+ *   ports,    array of device paths
+ *   profiles, array of {:baud => 57600, :probe => "*IDN?"} tried in order
+ *   timeout,  seconds to wait for a reply to each probe, default 0.5
+ * Returns an array of {:device, :baud, :probe, :identity} for every
+ * port that answered.  See SerialDevice.discover for the friendly version.
+ */
+VALUE rsd_probe(int argc, VALUE *argv, VALUE sdClass)
+{
+  RSD_DISCOVER_T d;
+  VALUE ports, profiles, timeout, profile, found, entry;
+  int i;
+
+  rb_scan_args(argc, argv, "21", &ports, &profiles, &timeout);
+  Check_Type(ports, T_ARRAY);
+  Check_Type(profiles, T_ARRAY);
+
+  d.n_devices = RARRAY_LEN(ports);
+  d.n_profiles = RARRAY_LEN(profiles);
+  d.deadline_ms = NIL_P(timeout) ? 500 : (int)(NUM2DBL(timeout) * 1000);
+  found = rb_ary_new();
+  if (0 == d.n_devices || 0 == d.n_profiles) {
+    return found;
+  }
+
+  // Validate everything before allocating
+  for (i = 0; i < d.n_devices; i++) {
+    entry = rb_ary_entry(ports, i);
+    StringValueCStr(entry);
+  }
+  for (i = 0; i < d.n_profiles; i++) {
+    profile = rb_ary_entry(profiles, i);
+    Check_Type(profile, T_HASH);
+    entry = rb_hash_aref(profile, PROBE_SYMBOL);
+    StringValueCStr(entry);
+    if (B0 == sd_baud_lookup(NUM2INT(rb_hash_aref(profile, BAUDRATE_SYMBOL)))) {
+      rb_raise(rb_eException, "Unsupported baud rate in probe profile %d", i);
+    }
+  }
+
+  // Copy strings out so the probe threads never touch Ruby objects
+  d.devices = ALLOC_N(char *, d.n_devices);
+  for (i = 0; i < d.n_devices; i++) {
+    entry = rb_ary_entry(ports, i);
+    d.devices[i] = ruby_strdup(StringValueCStr(entry));
+  }
+  d.profiles = ALLOC_N(SD_PROBE_PROFILE, d.n_profiles);
+  for (i = 0; i < d.n_profiles; i++) {
+    profile = rb_ary_entry(profiles, i);
+    entry = rb_hash_aref(profile, PROBE_SYMBOL);
+    d.profiles[i].baudrate = NUM2INT(rb_hash_aref(profile, BAUDRATE_SYMBOL));
+    d.profiles[i].probe = ruby_strdup(StringValueCStr(entry));
+  }
+  d.results = ALLOC_N(SD_PROBE_RESULT, d.n_devices);
+  d.cancel = 0;
+
+  rb_thread_call_without_gvl(rsd_probe_nogvl, &d, rsd_probe_ubf, &d);
+
+  for (i = 0; i < d.n_devices; i++) {
+    if (0 <= d.results[i].profile) {
+      entry = rb_hash_new();
+      rb_hash_aset(entry, DEVICE_SYMBOL, rb_str_new2(d.devices[i]));
+      rb_hash_aset(entry, BAUDRATE_SYMBOL, INT2NUM(d.profiles[d.results[i].profile].baudrate));
+      rb_hash_aset(entry, PROBE_SYMBOL, rb_str_new2(d.profiles[d.results[i].profile].probe));
+      rb_hash_aset(entry, IDENTITY_SYMBOL, rb_str_new2(d.results[i].response));
+      rb_ary_push(found, entry);
+    }
+    xfree(d.devices[i]);
+  }
+  for (i = 0; i < d.n_profiles; i++) {
+    xfree(d.profiles[i].probe);
+  }
+  xfree(d.devices);
+  xfree(d.profiles);
+  xfree(d.results);
+  rb_thread_check_ints();
+
+  return found;
+}
+
+/**
+ * Start recording a timeline of every write, read, first byte,
+ * timeout and error on all devices.  Optional argument is the number
+ * of events kept, the oldest are overwritten.  Starting again
+ * discards the previous trace.
+ */
+VALUE rsd_trace_start(int argc, VALUE *argv, VALUE sdClass)
+{
+  VALUE capacity;
+
+  rb_scan_args(argc, argv, "01", &capacity);
+  if ( SERIAL_DEVICE_OK != sd_trace_enable(NIL_P(capacity) ? 0 : NUM2INT(capacity)) ) {
+    rb_raise(rb_eException, "Could not allocate trace buffer");
+  }
+  return Qnil;
+}
+
+/**
+ * Stop recording, the trace is kept for dump_trace
+ */
+VALUE rsd_trace_stop(VALUE sdClass)
+{
+  sd_trace_disable();
+  return Qnil;
+}
+
+/**
+ * Write the trace as Chrome trace JSON for chrome://tracing or
+ * ui.perfetto.dev.  Returns the number of events written.
+ */
+VALUE rsd_dump_trace(VALUE sdClass, VALUE path)
+{
+  int n = sd_trace_dump(StringValueCStr(path));
+  if (0 > n) {
+    rb_sys_fail(StringValueCStr(path));
+  }
+  return INT2NUM(n);
+}
+
+/**
+ * Create a fan-out stream over this device.
+ * Optional argument is the ring buffer size in bytes.
+ * The stream owns reading the device once started.
+ */
+VALUE rsd_stream(int argc, VALUE *argv, VALUE self)
+{
+  SERIAL_DEVICE sd;
+  SD_STREAM st;
+  VALUE capacity;
+
+  sd = rsd_device(self, 0);
+  rb_scan_args(argc, argv, "01", &capacity);
+
+  st = sd_stream_new(sd, NIL_P(capacity) ? 0 : NUM2INT(capacity));
+  if (NULL == st) {
+    rb_raise(rb_eException, "Error creating stream");
+  }
+  return Data_Wrap_Struct(cStream, 0, sd_stream_release, st);
+}
+
+/**
+ * Start the reader thread
+ */
+VALUE rsd_stream_start(VALUE self)
+{
+  SD_STREAM st;
+  Data_Get_Struct(self, SD_STREAM_T, st);
+  int err = sd_stream_start(st);
+  if ( SERIAL_DEVICE_OK != err ) {
+    rb_raise(rb_eException, sd_errstring(err));
+  }
+  return self;
+}
+
+static void *rsd_stream_stop_nogvl(void *st)
+{
+  sd_stream_stop((SD_STREAM)st);
+  return NULL;
+}
+
+/**
+ * Stop the reader thread.  Subscribers may drain what is left.
+ */
+VALUE rsd_stream_stop(VALUE self)
+{
+  SD_STREAM st;
+  Data_Get_Struct(self, SD_STREAM_T, st);
+  rb_thread_call_without_gvl(rsd_stream_stop_nogvl, st, RUBY_UBF_IO, NULL);
+  return self;
+}
+
+/**
+ * True while the reader thread is running
+ */
+VALUE rsd_stream_running(VALUE self)
+{
+  SD_STREAM st;
+  Data_Get_Struct(self, SD_STREAM_T, st);
+  return st->running ? Qtrue : Qfalse;
+}
+
+/**
+ * Total number of bytes published so far
+ */
+VALUE rsd_stream_position(VALUE self)
+{
+  SD_STREAM st;
+  Data_Get_Struct(self, SD_STREAM_T, st);
+  return ULL2NUM(st->head);
+}
+
+static void rsd_subscriber_free(RSD_SUBSCRIBER_T *rsub)
+{
+  sd_stream_unsubscribe(rsub->sub);
+  free(rsub);
+}
+
+/**
+ * Add a subscriber with its own cursor.
+ * policy is one of :drop (default), :block or :coalesce
+ */
+VALUE rsd_stream_subscribe(int argc, VALUE *argv, VALUE self)
+{
+  SD_STREAM st;
+  RSD_SUBSCRIBER_T *rsub;
+  VALUE policy_value;
+  int policy;
+
+  Data_Get_Struct(self, SD_STREAM_T, st);
+  rb_scan_args(argc, argv, "01", &policy_value);
+
+  if (NIL_P(policy_value) || policy_value == DROP_SYMBOL) {
+    policy = SD_STREAM_POLICY_DROP;
+  } else if (policy_value == BLOCK_SYMBOL) {
+    policy = SD_STREAM_POLICY_BLOCK;
+  } else if (policy_value == COALESCE_SYMBOL) {
+    policy = SD_STREAM_POLICY_COALESCE;
+  } else {
+    rb_raise(rb_eException, "Policy must be :drop, :block, or :coalesce");
+  }
+
+  rsub = ALLOC(RSD_SUBSCRIBER_T);
+  rsub->cancel = 0;
+  rsub->readers = 0;
+  rsub->closing = 0;
+  rsub->sub = sd_stream_subscribe(st, policy, NULL, NULL);
+  if (NULL == rsub->sub) {
+    free(rsub);
+    rb_raise(rb_eException, "Error subscribing to stream");
+  }
+  return Data_Wrap_Struct(cSubscriber, 0, rsd_subscriber_free, rsub);
+}
+
+static void *rsd_subscriber_read_nogvl(void *arg)
+{
+  RSD_SUBSCRIBER_READ_T *r = (RSD_SUBSCRIBER_READ_T *)arg;
+  r->result = sd_subscriber_read(r->rsub->sub, r->buf, r->n, r->timeout_ms, &r->rsub->cancel);
+  return NULL;
+}
+
+static void rsd_subscriber_read_ubf(void *arg)
+{
+  RSD_SUBSCRIBER_T *rsub = (RSD_SUBSCRIBER_T *)arg;
+  rsub->cancel = 1;
+  sd_stream_wake(rsub->sub->stream);
+}
+
+/**
+ * Wait for and copy out the next chunk for a subscriber.
+ * Returns nil on timeout, *err is negative once the stream is done.
+ */
+static VALUE rsd_subscriber_fetch(RSD_SUBSCRIBER_T *rsub, int n, int timeout_ms, int *err)
+{
+  RSD_SUBSCRIBER_READ_T r;
+  VALUE str;
+
+  if (NULL == rsub->sub || rsub->closing) {
+    rb_raise(rb_eException, "Subscriber is closed");
+  }
+  if (0 >= n) {
+    rb_raise(rb_eException, "Read size must be positive");
+  }
+
+  str = rb_str_buf_new(n);
+  r.rsub = rsub;
+  r.buf = RSTRING_PTR(str);
+  r.n = n;
+  r.timeout_ms = timeout_ms;
+  rsub->cancel = 0;
+  rsub->readers++;
+  rb_thread_call_without_gvl(rsd_subscriber_read_nogvl, &r, rsd_subscriber_read_ubf, rsub);
+  rsub->readers--;
+
+  /* The last reader out finishes a close made while it was waiting */
+  if (rsub->closing && 0 == rsub->readers) {
+    sd_stream_unsubscribe(rsub->sub);
+    rsub->sub = NULL;
+    rsub->closing = 0;
+  }
+  rb_thread_check_ints();
+
+  *err = 0 > r.result ? r.result : SERIAL_DEVICE_OK;
+  if (0 >= r.result) {
+    return Qnil;
+  }
+  rb_str_set_len(str, r.result);
+  return str;
+}
+
+/**
+ * Read up to max bytes (default 4096) past this subscriber's cursor,
+ * waiting up to timeout seconds (default forever).
+ * Returns nil on timeout, raises once the stream has stopped and drained.
+ */
+VALUE rsd_subscriber_read(int argc, VALUE *argv, VALUE self)
+{
+  RSD_SUBSCRIBER_T *rsub;
+  VALUE max, timeout, str;
+  int err;
+
+  Data_Get_Struct(self, RSD_SUBSCRIBER_T, rsub);
+  rb_scan_args(argc, argv, "02", &max, &timeout);
+
+  str = rsd_subscriber_fetch(rsub,
+			     NIL_P(max) ? 4096 : NUM2INT(max),
+			     NIL_P(timeout) ? -1 : (int)(NUM2DBL(timeout) * 1000),
+			     &err);
+  if ( SERIAL_DEVICE_OK != err ) {
+    rb_raise(rb_eException, sd_errstring(err));
+  }
+  return str;
+}
+
+/**
+ * Yield each chunk as it arrives until the stream stops and drains
+ */
+VALUE rsd_subscriber_each(VALUE self)
+{
+  RSD_SUBSCRIBER_T *rsub;
+  VALUE chunk;
+  int err = SERIAL_DEVICE_OK;
+
+  Data_Get_Struct(self, RSD_SUBSCRIBER_T, rsub);
+  while (SERIAL_DEVICE_OK == err && NULL != rsub->sub && !rsub->closing) {
+    chunk = rsd_subscriber_fetch(rsub, 4096, -1, &err);
+    if (!NIL_P(chunk)) {
+      rb_yield(chunk);
+    }
+  }
+  return self;
+}
+
+/**
+ * Bytes published but not yet read by this subscriber
+ */
+VALUE rsd_subscriber_pending(VALUE self)
+{
+  RSD_SUBSCRIBER_T *rsub;
+  Data_Get_Struct(self, RSD_SUBSCRIBER_T, rsub);
+  return INT2NUM(sd_subscriber_pending(rsub->sub));
+}
+
+/**
+ * Bytes lost to the :drop or :coalesce policy
+ */
+VALUE rsd_subscriber_dropped(VALUE self)
+{
+  RSD_SUBSCRIBER_T *rsub;
+  Data_Get_Struct(self, RSD_SUBSCRIBER_T, rsub);
+  return NULL == rsub->sub ? INT2FIX(0) : ULL2NUM(rsub->sub->dropped);
+}
+
+/**
+ * Detach from the stream.  A :block subscriber must do this
+ * (or keep reading) or the reader will stall.
+ * Threads blocked in read or each on this subscriber return nil or
+ * finish, and the last of them does the detaching.
+ */
+VALUE rsd_subscriber_close(VALUE self)
+{
+  RSD_SUBSCRIBER_T *rsub;
+  Data_Get_Struct(self, RSD_SUBSCRIBER_T, rsub);
+  if (NULL == rsub->sub) {
+    return Qnil;
+  }
+  if (0 < rsub->readers) {
+    rsub->closing = 1;
+    rsub->cancel = 1;
+    sd_stream_wake(rsub->sub->stream);
+  } else {
+    sd_stream_unsubscribe(rsub->sub);
+    rsub->sub = NULL;
+  }
+  return Qnil;
+}
+
+/**
+ * Float option from a control loop hash, or default if absent
+ */
+static double rsd_control_option(VALUE options, VALUE key, double value)
+{
+  VALUE options_value = rb_hash_aref(options, key);
+  return NIL_P(options_value) ? value : NUM2DBL(options_value);
+}
+
+/**
+ * Copy a command option into a fixed size buffer
+ */
+static void rsd_control_command(VALUE options, VALUE key, char *command)
+{
+  VALUE options_value = rb_hash_aref(options, key);
+  if (NIL_P(options_value)) {
+    return;
+  }
+  StringValue(options_value);
+  if (RSTRING_LEN(options_value) >= SD_CONTROL_COMMAND_SIZE) {
+    rb_raise(rb_eException, "Command too long");
+  }
+  strcpy(command, StringValueCStr(options_value));
+}
+
+/**
+ * Create a PID loop which reads the process value from input and
+ * writes the correction to output, both SerialDevices.
+ * Takes an options hash which recognizes the following keys
+ *   :output,   required.  printf format for the output command, e.g. ":Piezo:Offset %0.3f"
+ *   :input,    command sent to the input device each cycle, nil to only listen
+ *   :record_length, bytes per binary record, nil for a text reply holding a number
+ *   :records,  binary records averaged per reading, defaults to 1
+ *   :field,    byte offset of the u16 column to average, defaults to 0
+ *   :kp, :ki, :kd, gains, default to 0
+ *   :setpoint, :initial, :min, :max, defaults to 0, 0, -inf and inf
+ *   :rate,     cycles per second, defaults to 10
+ *   :response_timeout, :idle, seconds to wait for the reply to start and end,
+ *              default to 0.1 and 0.01
+ *   :ack,      seconds to wait for the output device's reply, nil to not read it
+ */
+VALUE rsd_control_new(VALUE ctlClass, VALUE input, VALUE output, VALUE options)
+{
+  SERIAL_DEVICE in, out;
+  SD_CONTROL_CONFIG config;
+  SD_CONTROL c;
+  VALUE options_value;
+
+  if (!RTEST(rb_obj_is_kind_of(input, cSerialDevice))
+      || !RTEST(rb_obj_is_kind_of(output, cSerialDevice))) {
+    rb_raise(rb_eException, "Input and output must be SerialDevices");
+  }
+  in = rsd_device(input, 0);
+  out = rsd_device(output, 0);
+  Check_Type(options, T_HASH);
+
+  memset(&config, 0, sizeof(config));
+  options_value = rb_hash_aref(options, OUTPUT_SYMBOL);
+  if (NIL_P(options_value)) {
+    rb_raise(rb_eException, "Output format required");
+  }
+  rsd_control_command(options, OUTPUT_SYMBOL, config.output);
+  if (!sd_control_format_ok(config.output)) {
+    rb_raise(rb_eException, "Output format must have exactly one %%f, %%e or %%g");
+  }
+  rsd_control_command(options, INPUT_SYMBOL, config.input.command);
+
+  options_value = rb_hash_aref(options, RECORD_LENGTH_SYMBOL);
+  if (!NIL_P(options_value)) {
+    config.input.record_length = NUM2INT(options_value);
+    config.input.records = (int)rsd_control_option(options, RECORDS_SYMBOL, 1);
+    config.input.field = (int)rsd_control_option(options, FIELD_SYMBOL, 0);
+  }
+  config.input.first_ms = (int)(1000 * rsd_control_option(options, RESPONSE_TIMEOUT_SYMBOL, 0.1));
+  config.input.idle_ms = (int)(1000 * rsd_control_option(options, IDLE_SYMBOL, 0.01));
+  config.ack_ms = (int)(1000 * rsd_control_option(options, ACK_SYMBOL, 0));
+
+  config.kp = rsd_control_option(options, KP_SYMBOL, 0);
+  config.ki = rsd_control_option(options, KI_SYMBOL, 0);
+  config.kd = rsd_control_option(options, KD_SYMBOL, 0);
+  config.setpoint = rsd_control_option(options, SETPOINT_SYMBOL, 0);
+  config.initial = rsd_control_option(options, INITIAL_SYMBOL, 0);
+  config.out_min = rsd_control_option(options, MIN_SYMBOL, -HUGE_VAL);
+  config.out_max = rsd_control_option(options, MAX_SYMBOL, HUGE_VAL);
+  config.rate = rsd_control_option(options, RATE_SYMBOL, 10);
+
+  c = sd_control_new(in, out, &config);
+  if (NULL == c) {
+    rb_raise(rb_eException, "Invalid control loop settings");
+  }
+  return Data_Wrap_Struct(ctlClass, 0, sd_control_destroy, c);
+}
+
+/**
+ * Start the loop thread
+ */
+VALUE rsd_control_start(VALUE self)
+{
+  SD_CONTROL c;
+  Data_Get_Struct(self, SD_CONTROL_T, c);
+  int err = sd_control_start(c);
+  if ( SERIAL_DEVICE_OK != err ) {
+    rb_raise(rb_eException, sd_errstring(err));
+  }
+  rb_hash_aset(rsd_running_loops, self, Qtrue);
+  return self;
+}
+
+static void *rsd_control_stop_nogvl(void *c)
+{
+  sd_control_stop((SD_CONTROL)c);
+  return NULL;
+}
+
+/**
+ * Stop the loop thread once the cycle in progress finishes.
+ * A started loop is kept from the garbage collector until then.
+ */
+VALUE rsd_control_stop(VALUE self)
+{
+  SD_CONTROL c;
+  Data_Get_Struct(self, SD_CONTROL_T, c);
+  rb_thread_call_without_gvl(rsd_control_stop_nogvl, c, RUBY_UBF_IO, NULL);
+  rb_hash_delete(rsd_running_loops, self);
+  return self;
+}
+
+/**
+ * True while the loop is running.  A device error also stops it,
+ * see state[:last_error].
+ */
+VALUE rsd_control_running(VALUE self)
+{
+  SD_CONTROL c;
+  SD_CONTROL_STATE state;
+  Data_Get_Struct(self, SD_CONTROL_T, c);
+  sd_control_state(c, &state);
+  return state.running ? Qtrue : Qfalse;
+}
+
+/**
+ * Snapshot of the loop as a hash with :iterations, :input, :output,
+ * :error, :integral, :overruns, :misses, :cycle_time and :interval
+ * (seconds, the time between the last two readings the PID used) and
+ * :last_error, nil unless a device error stopped the loop
+ */
+VALUE rsd_control_state(VALUE self)
+{
+  SD_CONTROL c;
+  SD_CONTROL_STATE state;
+  VALUE result = rb_hash_new();
+
+  Data_Get_Struct(self, SD_CONTROL_T, c);
+  sd_control_state(c, &state);
+
+  rb_hash_aset(result, ITERATIONS_SYMBOL, ULL2NUM(state.iterations));
+  rb_hash_aset(result, INPUT_SYMBOL, rb_float_new(state.input));
+  rb_hash_aset(result, OUTPUT_SYMBOL, rb_float_new(state.output));
+  rb_hash_aset(result, ERROR_SYMBOL, rb_float_new(state.error));
+  rb_hash_aset(result, INTEGRAL_SYMBOL, rb_float_new(state.integral));
+  rb_hash_aset(result, OVERRUNS_SYMBOL, ULL2NUM(state.overruns));
+  rb_hash_aset(result, MISSES_SYMBOL, ULL2NUM(state.misses));
+  rb_hash_aset(result, CYCLE_TIME_SYMBOL, rb_float_new(state.cycle_ns / 1e9));
+  rb_hash_aset(result, INTERVAL_SYMBOL, rb_float_new(state.interval_ns / 1e9));
+  rb_hash_aset(result, LAST_ERROR_SYMBOL,
+	       SERIAL_DEVICE_OK == state.err ? Qnil : rb_str_new2(sd_errstring(state.err)));
+  return result;
+}
+
+/**
+ * Move the setpoint without restarting the loop
+ */
+VALUE rsd_control_set_setpoint(VALUE self, VALUE setpoint)
+{
+  SD_CONTROL c;
+  Data_Get_Struct(self, SD_CONTROL_T, c);
+  if (SERIAL_DEVICE_OK != sd_control_set_setpoint(c, NUM2DBL(setpoint))) {
+    rb_raise(rb_eException, "Setpoint must be a finite number");
+  }
+  return setpoint;
+}
+
+/**
+ * Change the gains without restarting the loop
+ */
+VALUE rsd_control_tune(VALUE self, VALUE kp, VALUE ki, VALUE kd)
+{
+  SD_CONTROL c;
+  Data_Get_Struct(self, SD_CONTROL_T, c);
+  if (SERIAL_DEVICE_OK != sd_control_set_gains(c, NUM2DBL(kp), NUM2DBL(ki), NUM2DBL(kd))) {
+    rb_raise(rb_eException, "Gains must be finite numbers");
+  }
+  return self;
+}
+
 void Init_RbSerialDevice() 
 {
     cSerialDevice = rb_define_class("SerialDevice", rb_cObject);
     rb_define_singleton_method(cSerialDevice, "new", rsd_new, 1);
+    rb_define_singleton_method(cSerialDevice, "open_shared", rsd_open_shared, 1);
+    rb_define_singleton_method(cSerialDevice, "probe", rsd_probe, -1);
+    rb_define_singleton_method(cSerialDevice, "trace_start", rsd_trace_start, -1);
+    rb_define_singleton_method(cSerialDevice, "trace_stop", rsd_trace_stop, 0);
+    rb_define_singleton_method(cSerialDevice, "dump_trace", rsd_dump_trace, 1);
     rb_define_method(cSerialDevice, "initialize", rsd_init, 1);
     rb_define_method(cSerialDevice, "send_message", rsd_send_message, 1);
     rb_define_method(cSerialDevice, "read", rsd_read, 0);
     rb_define_method(cSerialDevice, "write", rsd_write, 1);
     rb_define_method(cSerialDevice, "read_bytes", rsd_read_nbytes, 1);
+    rb_define_method(cSerialDevice, "read_bytes_stamped", rsd_read_nbytes_stamped, 1);
+    rb_define_method(cSerialDevice, "read_stamped", rsd_read_stamped, 0);
+    rb_define_method(cSerialDevice, "char_time_ns", rsd_char_time_ns, 0);
     rb_define_method(cSerialDevice, "close", rsd_close, 0);
+    rb_define_method(cSerialDevice, "acquire", rsd_acquire, -1);
+    rb_define_method(cSerialDevice, "stream", rsd_stream, -1);
+
+    // [ts_ns, first_ns, offset, length, queued] per chunk, CLOCK_MONOTONIC
+    rb_define_const(cSerialDevice, "STAMP_FORMAT", rb_str_new2("Q<Q<l<l<l<"));
+
+    cStream = rb_define_class_under(cSerialDevice, "Stream", rb_cObject);
+    rb_undef_alloc_func(cStream);
+    rb_define_method(cStream, "start", rsd_stream_start, 0);
+    rb_define_method(cStream, "stop", rsd_stream_stop, 0);
+    rb_define_method(cStream, "running?", rsd_stream_running, 0);
+    rb_define_method(cStream, "position", rsd_stream_position, 0);
+    rb_define_method(cStream, "subscribe", rsd_stream_subscribe, -1);
+
+    cSubscriber = rb_define_class_under(cSerialDevice, "Subscriber", rb_cObject);
+    rb_undef_alloc_func(cSubscriber);
+    rb_define_method(cSubscriber, "read", rsd_subscriber_read, -1);
+    rb_define_method(cSubscriber, "each", rsd_subscriber_each, 0);
+    rb_define_method(cSubscriber, "pending", rsd_subscriber_pending, 0);
+    rb_define_method(cSubscriber, "dropped", rsd_subscriber_dropped, 0);
+    rb_define_method(cSubscriber, "close", rsd_subscriber_close, 0);
+
+    cControlLoop = rb_define_class_under(cSerialDevice, "ControlLoop", rb_cObject);
+    rsd_running_loops = rb_hash_new();
+    rb_global_variable(&rsd_running_loops);
+    rb_undef_alloc_func(cControlLoop);
+    rb_define_singleton_method(cControlLoop, "new", rsd_control_new, 3);
+    rb_define_method(cControlLoop, "start", rsd_control_start, 0);
+    rb_define_method(cControlLoop, "stop", rsd_control_stop, 0);
+    rb_define_method(cControlLoop, "running?", rsd_control_running, 0);
+    rb_define_method(cControlLoop, "state", rsd_control_state, 0);
+    rb_define_method(cControlLoop, "setpoint=", rsd_control_set_setpoint, 1);
+    rb_define_method(cControlLoop, "tune", rsd_control_tune, 3);
 
     DEVICE_SYMBOL = ID2SYM(rb_intern("device"));
     BAUDRATE_SYMBOL = ID2SYM(rb_intern("baud"));
@@ -250,4 +1274,41 @@ void Init_RbSerialDevice()
     ODD_SYMBOL = ID2SYM(rb_intern("odd"));
     EVEN_SYMBOL = ID2SYM(rb_intern("even"));
     HARDWARE_FLOW_CONTROL_SYMBOL = ID2SYM(rb_intern("hw_flow"));
+    DROP_SYMBOL = ID2SYM(rb_intern("drop"));
+    BLOCK_SYMBOL = ID2SYM(rb_intern("block"));
+    COALESCE_SYMBOL = ID2SYM(rb_intern("coalesce"));
+    RECORD_LENGTH_SYMBOL = ID2SYM(rb_intern("record_length"));
+    FIELDS_SYMBOL = ID2SYM(rb_intern("fields"));
+    DECIMATE_SYMBOL = ID2SYM(rb_intern("decimate"));
+    RAW_SYMBOL = ID2SYM(rb_intern("raw"));
+    RECORDS_SYMBOL = ID2SYM(rb_intern("records"));
+    STATS_SYMBOL = ID2SYM(rb_intern("stats"));
+    DECIMATED_SYMBOL = ID2SYM(rb_intern("decimated"));
+    MEAN_SYMBOL = ID2SYM(rb_intern("mean"));
+    MIN_SYMBOL = ID2SYM(rb_intern("min"));
+    MAX_SYMBOL = ID2SYM(rb_intern("max"));
+    RMS_SYMBOL = ID2SYM(rb_intern("rms"));
+    PROBE_SYMBOL = ID2SYM(rb_intern("probe"));
+    IDENTITY_SYMBOL = ID2SYM(rb_intern("identity"));
+    INPUT_SYMBOL = ID2SYM(rb_intern("input"));
+    OUTPUT_SYMBOL = ID2SYM(rb_intern("output"));
+    FIELD_SYMBOL = ID2SYM(rb_intern("field"));
+    KP_SYMBOL = ID2SYM(rb_intern("kp"));
+    KI_SYMBOL = ID2SYM(rb_intern("ki"));
+    KD_SYMBOL = ID2SYM(rb_intern("kd"));
+    SETPOINT_SYMBOL = ID2SYM(rb_intern("setpoint"));
+    INITIAL_SYMBOL = ID2SYM(rb_intern("initial"));
+    RATE_SYMBOL = ID2SYM(rb_intern("rate"));
+    ACK_SYMBOL = ID2SYM(rb_intern("ack"));
+    RESPONSE_TIMEOUT_SYMBOL = ID2SYM(rb_intern("response_timeout"));
+    IDLE_SYMBOL = ID2SYM(rb_intern("idle"));
+    ITERATIONS_SYMBOL = ID2SYM(rb_intern("iterations"));
+    OVERRUNS_SYMBOL = ID2SYM(rb_intern("overruns"));
+    MISSES_SYMBOL = ID2SYM(rb_intern("misses"));
+    ERROR_SYMBOL = ID2SYM(rb_intern("error"));
+    INTEGRAL_SYMBOL = ID2SYM(rb_intern("integral"));
+    CYCLE_TIME_SYMBOL = ID2SYM(rb_intern("cycle_time"));
+    INTERVAL_SYMBOL = ID2SYM(rb_intern("interval"));
+    LAST_ERROR_SYMBOL = ID2SYM(rb_intern("last_error"));
+    RESTORE_SYMBOL = ID2SYM(rb_intern("restore"));
 }
@@ -1,2 +1,41 @@
 require 'mkmf'
-create_makefile("RbSerialDevice")
\ No newline at end of file
+have_library("pthread")
+
+# test_*.c are standalone programs, keep them out of the extension
+$srcs = Dir["*.c"].reject {|f| f =~ /^test_/ }
+create_makefile("RbSerialDevice")
+
+# `make test` builds and runs the C tests, then the Ruby ones against
+# the built extension, all on pseudo terminals
+File.open("Makefile", "a") do |mf|
+  mf.puts <<-EOF
+
+TESTS = test_serial_stream test_serial_reduce test_serial_control test_serial_shared test_serial_trace test_serial_stamped
+RUBY_TESTS = test_serial_stamped.rb test_serial_discovery.rb
+TEST_DEPS = test_serial.h serial_device.c serial_trace.c
+
+test_serial_stream: test_serial_stream.c serial_stream.c $(TEST_DEPS)
+	$(CC) -g -o $@ $(filter %.c,$^) -lpthread -lm
+
+test_serial_reduce: test_serial_reduce.c serial_reduce.c $(TEST_DEPS)
+	$(CC) -g -o $@ $(filter %.c,$^) -lpthread -lm
+
+test_serial_control: test_serial_control.c serial_control.c serial_reduce.c $(TEST_DEPS)
+	$(CC) -g -o $@ $(filter %.c,$^) -lpthread -lm
+
+test_serial_shared: test_serial_shared.c $(TEST_DEPS)
+	$(CC) -g -o $@ $(filter %.c,$^) -lpthread -lm
+
+test_serial_trace: test_serial_trace.c $(TEST_DEPS)
+	$(CC) -g -o $@ $(filter %.c,$^) -lpthread -lm
+
+test_serial_stamped: test_serial_stamped.c $(TEST_DEPS)
+	$(CC) -g -o $@ $(filter %.c,$^) -lpthread -lm
+
+test: $(TESTS) $(DLLIB)
+	@for t in $(TESTS); do echo $$t; ./$$t || exit 1; done
+	@for t in $(RUBY_TESTS); do echo $$t; $(RUBY) -I. $$t || exit 1; done
+
+.PHONY: test
+  EOF
+end
@@ -36,11 +36,23 @@ class M6812 < Base
     @row_size
   end
 
+  # Byte offsets of the big-endian u16 columns in a sample record
+  FIELDS = {:time => 0, :ch0 => 3, :ch1 => 5}
+
   # Instruct the board to sample
   # returns an array of bytes of length record_length*num_sample_points
   # Because there have a priori knowledge of the structure of that 
   # it is split into consituent data pieces and returned as a hash
-  def sample
+  #
+  # Any of these options reduces the data in c while it is read instead
+  # and returns the acquire hash, which always has :stats:
+  #   :summary  => true   only mean/min/max/rms of ch0 and ch1 under :stats
+  #   :decimate => n      n:1 averaged ch0/ch1 columns under :decimated
+  #   :raw      => true   also keep the full resolution bytes as a String
+  def sample(options = {})
+    if options[:summary] or options[:decimate] or options[:raw]
+      return sample_reduced(options)
+    end
     points = self.num_sample_points
     size = points * self.record_length
     self.write("SAMPLE")
@@ -61,6 +73,16 @@ class M6812 < Base
   end
 
 
+  # Native reduction of a sample, see sample
+  def sample_reduced(options = {})
+    size = self.num_sample_points * self.record_length
+    self.write("SAMPLE")
+    self.acquire(size, :record_length => self.record_length,
+                 :fields => {:ch0 => FIELDS[:ch0], :ch1 => FIELDS[:ch1]},
+                 :decimate => options[:decimate],
+                 :raw => options[:raw])
+  end
+
   # Guarantee to read n bytes
   # raises an exception if it cant.
   def get_n_bytes(n)
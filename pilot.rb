@@ -1,5 +1,6 @@
 require 'RbSerialDevice'
 require 'serial_device_accessors'
+require 'm6812'
 
 # Convenience class for communicating with pilot laser control
 # supports a handful of common method
@@ -7,6 +8,10 @@ class Pilot < Base
   
   PIEZO_MIN = -13
   PIEZO_MAX = 13
+
+  # Fraction of the SAMPLE transfer rate piezo_lock runs at, leaving
+  # time for the board to sample and the offset to be written
+  PIEZO_LOCK_HEADROOM = 0.75
   
   sd_reader "*idn?", :identity
   sd_writer ":System:echo %s", :echo
@@ -73,6 +78,35 @@ class Pilot < Base
     true
   end
 
+  # Hold an M6812 channel at :setpoint, which is required, by steering
+  # the piezo offset.
+  # Returns a started SerialDevice::ControlLoop; stop it when done.
+  # Options are passed to ControlLoop.new, :channel picks the M6812
+  # column (default :ch0).  The offset stays within PIEZO_MIN..PIEZO_MAX
+  # and starts from where the piezo currently is.  :rate defaults to
+  # what a full SAMPLE transfer allows at the board's baud rate.
+  # Neither device can be used from Ruby until the loop is stopped.
+  def piezo_lock(board, options = {})
+    raise ArgumentError, "piezo_lock needs a :setpoint" unless options[:setpoint]
+    options = options.dup
+    channel = options.delete(:channel) || :ch0
+    transfer = board.num_sample_points * board.record_length * board.char_time_ns
+    defaults = {
+      :rate => transfer > 0 ? PIEZO_LOCK_HEADROOM * 1e9 / transfer : 1,
+      :input => "SAMPLE",
+      :record_length => board.record_length,
+      :records => board.num_sample_points,
+      :field => M6812::FIELDS[channel],
+      :output => ":Piezo:Offset %0.3f",
+      :min => PIEZO_MIN,
+      :max => PIEZO_MAX,
+      :initial => piezo_offset.to_f,
+      :ack => 0.1
+    }
+    control = SerialDevice::ControlLoop.new(board, self, defaults.merge(options))
+    control.start
+  end
+
   # Laser controller identity
   LASERID         = "LASERID"
   
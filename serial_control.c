@@ -0,0 +1,512 @@
+/*
+ * Closed loop PID control between two serial devices, i.e. holding an
+ * M6812 channel steady by adjusting the pilot, run on its own thread
+ * at a fixed rate.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "serial_control.h"
+
+/* Silence that ends the output device's acknowledgement */
+#define SD_CONTROL_ACK_IDLE_MS 5
+
+/* Bound on draining a device that never goes quiet, about a second */
+#define SD_CONTROL_DRAIN_MAX_READS 100
+
+/**
+ * Monotonic clock in nanoseconds
+ */
+static unsigned long long sd_control_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Check the output template before it is handed to snprintf
+ */
+int sd_control_format_ok(const char *fmt)
+{
+  int conversions = 0;
+
+  for (; '\0' != *fmt; fmt++) {
+    if ('%' != *fmt) {
+      continue;
+    }
+    fmt++;
+    if ('%' == *fmt) {
+      continue;
+    }
+    while ('\0' != *fmt && NULL != strchr("-+ #0123456789.", *fmt)) {
+      fmt++;
+    }
+    if ('\0' == *fmt || NULL == strchr("fFeEgG", *fmt)) {
+      return 0;
+    }
+    conversions++;
+  }
+  return 1 == conversions;
+}
+
+/**
+ * First number in a text reply such as "OK -1.900"
+ * @returns 1 if one was found
+ */
+static int sd_control_parse(const char *s, double *value)
+{
+  char *end;
+
+  for (; '\0' != *s; s++) {
+    if (NULL != strchr("+-.0123456789", *s)) {
+      *value = strtod(s, &end);
+      if (end != s) {
+	return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+/**
+ * Throw input away until the device has been quiet for quiet_ms, so
+ * the rest of a late reply is not taken for the start of the next.
+ * Gives up after SD_CONTROL_DRAIN_MAX_READS in case it never goes quiet.
+ */
+static int sd_control_drain(SERIAL_DEVICE sd, int quiet_ms)
+{
+  char buf[SD_CONTROL_COMMAND_SIZE];
+  int quiet = 0;
+  int reads, n;
+
+  for (reads = 0; quiet < quiet_ms && reads < SD_CONTROL_DRAIN_MAX_READS; reads++) {
+    /* sd_read_nbytes waits 10 ms for data */
+    n = sd_read_nbytes(sd, SD_CONTROL_COMMAND_SIZE, buf);
+    if (0 > n && EINTR != errno && EAGAIN != errno) {
+      return SERIAL_DEVICE_ERR_READ;
+    }
+    quiet = (0 < n) ? 0 : quiet + 10;
+  }
+  return SERIAL_DEVICE_OK;
+}
+
+/**
+ * Take one reading from the input device
+ * @returns SERIAL_DEVICE_OK with *have set if a value was read
+ */
+static int sd_control_read(SD_CONTROL c, double *value, int *have)
+{
+  SD_CONTROL_INPUT *in = &c->config.input;
+  double rms;
+  unsigned int min, max;
+  int err = SERIAL_DEVICE_OK;
+
+  *have = 0;
+  if ('\0' != in->command[0]) {
+    /* Replies to earlier commands must not be read as this one's */
+    sd_flush_input(c->in);
+    err = sd_write(c->in, in->command);
+    if (SERIAL_DEVICE_OK != err) {
+      return err;
+    }
+  }
+
+  if (0 < in->record_length) {
+    sd_reducer_reset(c->reducer);
+    err = sd_acquire_reduced(c->in, in->records * in->record_length, c->reducer, NULL);
+    if (SERIAL_DEVICE_ERR_STUCK == err) {
+      err = SERIAL_DEVICE_OK;
+    } else if (SERIAL_DEVICE_OK == err && 0 < c->reducer->records) {
+      sd_reducer_stats(c->reducer, 0, value, &min, &max, &rms);
+      *have = 1;
+    }
+  } else {
+    err = sd_read_timeout(c->in, in->first_ms, in->idle_ms);
+    if (SERIAL_DEVICE_OK == err) {
+      *have = sd_control_parse(c->in->last_response, value);
+    }
+  }
+
+  /*
+    A reply that stalled part way, or never came, may still be on its
+    way.  Wait it out so the next cycle starts on a record boundary.
+  */
+  if (SERIAL_DEVICE_OK == err && !*have && '\0' != in->command[0]) {
+    err = sd_control_drain(c->in, in->first_ms);
+  }
+
+  return err;
+}
+
+/**
+ * One input, PID update and output
+ * @returns a device error that should stop the loop
+ */
+static int sd_control_cycle(SD_CONTROL c)
+{
+  SD_CONTROL_CONFIG *cfg = &c->config;
+  char command[SD_CONTROL_COMMAND_SIZE];
+  double x, e, dt, integral, derivative, u;
+  double kp, ki, kd, setpoint;
+  unsigned long long now;
+  int have, first, err;
+
+  err = sd_control_read(c, &x, &have);
+  if (SERIAL_DEVICE_OK != err || !have) {
+    pthread_mutex_lock(&c->lock);
+    c->state.misses++;
+    pthread_mutex_unlock(&c->lock);
+    return err;
+  }
+
+  now = sd_control_now();
+
+  pthread_mutex_lock(&c->lock);
+  kp = cfg->kp;
+  ki = cfg->ki;
+  kd = cfg->kd;
+  setpoint = cfg->setpoint;
+  integral = c->state.integral;
+  pthread_mutex_unlock(&c->lock);
+
+  /*
+    Integrate and differentiate over the time since the last good
+    reading, which overruns and misses can make far longer than the
+    period.  The first reading has no history so it counts as a period.
+  */
+  first = (0 == c->last_ns);
+  dt = first ? 1.0 / cfg->rate : (now - c->last_ns) / 1e9;
+  e = setpoint - x;
+
+  /* Derivative on the measurement so setpoint changes do not kick */
+  derivative = first ? 0.0 : -(x - c->last_input) / dt;
+  c->last_input = x;
+  c->last_ns = now;
+
+  u = cfg->initial + kp * e + ki * (integral + e * dt) + kd * derivative;
+
+  /* Clamp, and stop integrating while that would only wind up further */
+  if (u > cfg->out_max) {
+    u = cfg->out_max;
+    if (0 > e * ki) {
+      integral += e * dt;
+    }
+  } else if (u < cfg->out_min) {
+    u = cfg->out_min;
+    if (0 < e * ki) {
+      integral += e * dt;
+    }
+  } else {
+    integral += e * dt;
+  }
+
+  snprintf(command, SD_CONTROL_COMMAND_SIZE, cfg->output, u);
+  if (0 < cfg->ack_ms) {
+    sd_flush_input(c->out);
+  }
+  err = sd_write(c->out, command);
+  if (SERIAL_DEVICE_OK == err && 0 < cfg->ack_ms) {
+    err = sd_read_timeout(c->out, cfg->ack_ms, SD_CONTROL_ACK_IDLE_MS);
+  }
+
+  pthread_mutex_lock(&c->lock);
+  c->state.iterations++;
+  c->state.input = x;
+  c->state.output = u;
+  c->state.error = e;
+  c->state.integral = integral;
+  c->state.interval_ns = first ? 0 : (unsigned long long)(dt * 1e9);
+  pthread_mutex_unlock(&c->lock);
+
+  return err;
+}
+
+/**
+ * What the loop owns on each device while it runs.  The input is read
+ * and written, the output written and, with an acknowledgement, read.
+ */
+static void sd_control_claims(SD_CONTROL c, int *in, int *out)
+{
+  *in = SD_CLAIM_READ | SD_CLAIM_WRITE;
+  *out = SD_CLAIM_WRITE | (0 < c->config.ack_ms ? SD_CLAIM_READ : 0);
+  if (c->in == c->out) {
+    *in |= *out;
+    *out = 0;
+  }
+}
+
+static void sd_control_unclaim(SD_CONTROL c)
+{
+  int in, out;
+  sd_control_claims(c, &in, &out);
+  sd_unclaim(c->in, in);
+  sd_unclaim(c->out, out);
+}
+
+/**
+ * Release everything a loop holds, once no thread is using it
+ */
+static void sd_control_free(SD_CONTROL c)
+{
+  pthread_cond_destroy(&c->wake);
+  pthread_mutex_destroy(&c->lock);
+  sd_reducer_free(c->reducer);
+  sd_destroy(c->in);
+  sd_destroy(c->out);
+  free(c);
+}
+
+/**
+ * Loop thread, runs cycles on a fixed schedule until stopped
+ */
+static void *sd_control_run(void *arg)
+{
+  SD_CONTROL c = (SD_CONTROL)arg;
+  unsigned long long period = (unsigned long long)(1e9 / c->config.rate);
+  unsigned long long next = sd_control_now();
+  unsigned long long start, now;
+  struct timespec ts;
+  int err, orphaned;
+
+  pthread_mutex_lock(&c->lock);
+  while (c->state.running) {
+    pthread_mutex_unlock(&c->lock);
+
+    start = sd_control_now();
+    err = sd_control_cycle(c);
+    now = sd_control_now();
+
+    pthread_mutex_lock(&c->lock);
+    c->state.cycle_ns = now - start;
+    if (SERIAL_DEVICE_OK != err) {
+      c->state.err = err;
+      break;
+    }
+
+    /* Late cycles are counted, not made up with a burst */
+    next += period;
+    if (now > next) {
+      c->state.overruns++;
+      next = now;
+      continue;
+    }
+
+    ts.tv_sec = next / 1000000000ULL;
+    ts.tv_nsec = next % 1000000000ULL;
+    while (c->state.running
+	   && ETIMEDOUT != pthread_cond_timedwait(&c->wake, &c->lock, &ts)) {
+    }
+  }
+  c->state.running = 0;
+  pthread_mutex_unlock(&c->lock);
+
+  sd_control_unclaim(c);
+
+  pthread_mutex_lock(&c->lock);
+  orphaned = c->orphaned;
+  c->exited = 1;
+  pthread_mutex_unlock(&c->lock);
+
+  if (orphaned) {
+    sd_control_free(c);
+  }
+  return NULL;
+}
+
+/**
+ * Gains have to be finite, NaN would poison the integral for good
+ */
+static int sd_control_gains_ok(double kp, double ki, double kd)
+{
+  return isfinite(kp) && isfinite(ki) && isfinite(kd);
+}
+
+/**
+ * Create a loop
+ */
+SD_CONTROL sd_control_new(SERIAL_DEVICE in, SERIAL_DEVICE out, SD_CONTROL_CONFIG *config)
+{
+  SD_CONTROL c;
+  pthread_condattr_t attr;
+
+  /* Written so that NaN fails every test, the limits may be infinite */
+  if (NULL == in || NULL == out || NULL == config
+      || !(config->rate > 0) || !isfinite(config->rate)
+      || !(config->out_min <= config->out_max)
+      || !sd_control_gains_ok(config->kp, config->ki, config->kd)
+      || !isfinite(config->setpoint) || !isfinite(config->initial)
+      || !sd_control_format_ok(config->output)) {
+    return NULL;
+  }
+  if (0 < config->input.record_length
+      && (0 >= config->input.records
+	  || 0 > config->input.field
+	  || config->input.field + 2 > config->input.record_length)) {
+    return NULL;
+  }
+
+  c = (SD_CONTROL)calloc(1, sizeof(SD_CONTROL_T));
+  if (NULL == c) {
+    return NULL;
+  }
+  c->config = *config;
+
+  if (0 < config->input.record_length) {
+    c->reducer = sd_reducer_new(config->input.record_length, 0);
+    if (NULL == c->reducer) {
+      free(c);
+      return NULL;
+    }
+    sd_reducer_add_field(c->reducer, config->input.field);
+  }
+
+  c->in = sd_retain(in);
+  c->out = sd_retain(out);
+  c->state.output = config->initial;
+
+  pthread_mutex_init(&c->lock, NULL);
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&c->wake, &attr);
+  pthread_condattr_destroy(&attr);
+
+  return c;
+}
+
+/**
+ * Spawn the loop thread, claiming both devices from Ruby and streams
+ */
+int sd_control_start(SD_CONTROL c)
+{
+  int err = SERIAL_DEVICE_OK;
+  int in, out;
+
+  if (NULL == c) {
+    return SERIAL_DEVICE_ERR_NULL;
+  }
+
+  pthread_mutex_lock(&c->lock);
+  /* A thread that stopped on a device error has let go, reap it */
+  if (c->started && c->exited) {
+    pthread_join(c->thread, NULL);
+    c->started = 0;
+  }
+  if (!c->started) {
+    sd_control_claims(c, &in, &out);
+    err = sd_claim(c->in, in);
+    if (SERIAL_DEVICE_OK == err && 0 != out) {
+      err = sd_claim(c->out, out);
+      if (SERIAL_DEVICE_OK != err) {
+	sd_unclaim(c->in, in);
+      }
+    }
+  }
+  if (!c->started && SERIAL_DEVICE_OK == err) {
+    c->state.running = 1;
+    c->state.err = SERIAL_DEVICE_OK;
+    c->last_ns = 0;
+    c->exited = 0;
+    if (0 != pthread_create(&c->thread, NULL, sd_control_run, c)) {
+      c->state.running = 0;
+      sd_control_unclaim(c);
+      err = SERIAL_DEVICE_ERR_THREAD;
+    } else {
+      c->started = 1;
+    }
+  }
+  pthread_mutex_unlock(&c->lock);
+
+  return err;
+}
+
+/**
+ * Ask the loop to finish and wait for it
+ */
+void sd_control_stop(SD_CONTROL c)
+{
+  int join;
+
+  if (NULL == c) {
+    return;
+  }
+
+  pthread_mutex_lock(&c->lock);
+  c->state.running = 0;
+  join = c->started;
+  c->started = 0;
+  pthread_cond_broadcast(&c->wake);
+  pthread_mutex_unlock(&c->lock);
+
+  if (join) {
+    pthread_join(c->thread, NULL);
+  }
+}
+
+int sd_control_set_setpoint(SD_CONTROL c, double setpoint)
+{
+  if (NULL == c || !isfinite(setpoint)) {
+    return SERIAL_DEVICE_ERR_NULL;
+  }
+  pthread_mutex_lock(&c->lock);
+  c->config.setpoint = setpoint;
+  pthread_mutex_unlock(&c->lock);
+  return SERIAL_DEVICE_OK;
+}
+
+int sd_control_set_gains(SD_CONTROL c, double kp, double ki, double kd)
+{
+  if (NULL == c || !sd_control_gains_ok(kp, ki, kd)) {
+    return SERIAL_DEVICE_ERR_NULL;
+  }
+  pthread_mutex_lock(&c->lock);
+  c->config.kp = kp;
+  c->config.ki = ki;
+  c->config.kd = kd;
+  pthread_mutex_unlock(&c->lock);
+  return SERIAL_DEVICE_OK;
+}
+
+void sd_control_state(SD_CONTROL c, SD_CONTROL_STATE *state)
+{
+  pthread_mutex_lock(&c->lock);
+  *state = c->state;
+  pthread_mutex_unlock(&c->lock);
+}
+
+/**
+ * Stop and free a loop without waiting on a running cycle
+ */
+void sd_control_destroy(SD_CONTROL c)
+{
+  pthread_t thread;
+  int join, detach;
+
+  if (NULL == c) {
+    return;
+  }
+
+  pthread_mutex_lock(&c->lock);
+  c->state.running = 0;
+  thread = c->thread;
+  detach = c->started && !c->exited;
+  join = c->started && c->exited;
+  c->orphaned = detach;
+  c->started = 0;
+  pthread_cond_broadcast(&c->wake);
+  pthread_mutex_unlock(&c->lock);
+
+  if (detach) {
+    pthread_detach(thread);
+    return;
+  }
+  /* The thread has already let go of the loop and is only returning */
+  if (join) {
+    pthread_join(thread, NULL);
+  }
+  sd_control_free(c);
+}
@@ -0,0 +1,116 @@
+#ifndef SERIAL_CONTROL_H
+#define SERIAL_CONTROL_H
+
+#include <pthread.h>
+#include "serial_device.h"
+#include "serial_reduce.h"
+
+#define SD_CONTROL_COMMAND_SIZE 255
+
+// How the process value is read from the input device
+typedef struct {
+	char command[SD_CONTROL_COMMAND_SIZE];  /* sent each cycle, empty to only listen */
+	int first_ms;        /* wait for the reply to start */
+	int idle_ms;         /* text replies end after this much silence */
+	int record_length;   /* 0 for a text reply holding a number */
+	int records;         /* binary replies: records per reading */
+	int field;           /* binary replies: offset of the u16 column to average */
+} SD_CONTROL_INPUT;
+
+// Settings for one PID loop
+typedef struct {
+	SD_CONTROL_INPUT input;
+	char output[SD_CONTROL_COMMAND_SIZE];   /* printf format with one double conversion */
+	int ack_ms;          /* wait for the output device's reply, 0 to not read it */
+	double kp, ki, kd;
+	double setpoint;
+	double out_min, out_max;
+	double initial;      /* output before the first correction */
+	double rate;         /* cycles per second */
+} SD_CONTROL_CONFIG;
+
+// Published state of a loop
+typedef struct {
+	unsigned long long iterations;
+	unsigned long long overruns;   /* cycles that took longer than the period */
+	unsigned long long misses;     /* cycles with no usable input */
+	double input;
+	double output;
+	double error;
+	double integral;
+	unsigned long long cycle_ns;   /* duration of the last cycle */
+	unsigned long long interval_ns; /* time between the last two readings */
+	int err;                       /* device error that stopped the loop */
+	int running;
+} SD_CONTROL_STATE;
+
+// A PID loop between two devices on its own thread
+typedef struct {
+	SERIAL_DEVICE in;
+	SERIAL_DEVICE out;
+	SD_CONTROL_CONFIG config;
+	SD_CONTROL_STATE state;
+	SD_REDUCER reducer;
+	double last_input;
+	unsigned long long last_ns;    /* when last_input was read, 0 before the first */
+	int started;
+	int exited;                    /* the thread is done with the loop */
+	int orphaned;                  /* destroyed while running, the thread frees it */
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+} SD_CONTROL_T;
+
+typedef SD_CONTROL_T* SD_CONTROL;
+
+/**
+ * True if fmt has exactly one floating point conversion and no others
+ */
+int sd_control_format_ok(const char *fmt);
+
+/**
+ * Create a loop reading in and writing out.  Holds a reference on both.
+ * @returns NULL if the configuration is unusable, including a rate
+ * that is not positive and gains, setpoint or limits that are NaN
+ */
+SD_CONTROL sd_control_new(SERIAL_DEVICE in, SERIAL_DEVICE out, SD_CONTROL_CONFIG *config);
+
+/**
+ * Start the loop thread.  Both devices are claimed with sd_claim until
+ * it exits, so they cannot be closed or read by a stream meanwhile.
+ * Also restarts a loop that stopped on a device error.
+ * @returns SERIAL_DEVICE_OK, SERIAL_DEVICE_ERR_THREAD or
+ * SERIAL_DEVICE_ERR_BUSY if a stream or another loop is using a device
+ */
+int sd_control_start(SD_CONTROL c);
+
+/**
+ * Stop the loop thread and wait for the cycle in progress to finish
+ */
+void sd_control_stop(SD_CONTROL c);
+
+/**
+ * Change the setpoint while running
+ * @returns SERIAL_DEVICE_ERR_NULL, leaving it alone, if it is not finite
+ */
+int sd_control_set_setpoint(SD_CONTROL c, double setpoint);
+
+/**
+ * Change the gains while running
+ * @returns SERIAL_DEVICE_ERR_NULL, leaving them alone, if any is not finite
+ */
+int sd_control_set_gains(SD_CONTROL c, double kp, double ki, double kd);
+
+/**
+ * Copy out a consistent snapshot of the state
+ */
+void sd_control_state(SD_CONTROL c, SD_CONTROL_STATE *state);
+
+/**
+ * Stop the loop and release both devices.  Does not wait for a cycle
+ * in progress: a running thread is told to stop and frees the loop
+ * itself when it gets out, so this is safe from a GC finalizer.
+ */
+void sd_control_destroy(SD_CONTROL c);
+
+#endif
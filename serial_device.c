@@ -9,13 +9,47 @@
 #include <termios.h>
 #include <fcntl.h>
 #include <sys/time.h>
+#include <sys/ioctl.h>
+#include <time.h>
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
 #include "serial_device.h"
+#include "serial_trace.h"
 
 #define BUFSIZE 255
 
+/* Not every platform has the linux names */
+#ifndef TIOCINQ
+#define TIOCINQ FIONREAD
+#endif
+
+static int sd_read_common(SERIAL_DEVICE sd, int first_ms, int idle_ms, SD_CHUNK_STAMP *stamps, int max_stamps, int *n_stamps);
+
+/* Process wide list of devices opened with sd_open_shared */
+static SERIAL_DEVICE sd_registry = NULL;
+static pthread_mutex_t sd_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Serializes sd_open_shared so a device is only ever opened once */
+static pthread_mutex_t sd_open_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * True if applying b over a would change nothing we configure
+ */
+static int sd_termios_equal(struct termios *a, struct termios *b)
+{
+  return a->c_iflag == b->c_iflag
+    && a->c_oflag == b->c_oflag
+    && a->c_cflag == b->c_cflag
+    && a->c_lflag == b->c_lflag
+    && a->c_cc[VMIN] == b->c_cc[VMIN]
+    && a->c_cc[VTIME] == b->c_cc[VTIME]
+    && cfgetispeed(a) == cfgetispeed(b)
+    && cfgetospeed(a) == cfgetospeed(b);
+}
+
 
 /** Return the error string for the given error */
 char *sd_errstring(int err)
@@ -44,6 +78,20 @@ char *sd_errstring(int err)
     retval = "Error writing: no room for data"; break;
   case SERIAL_DEVICE_ERR_WRITE_EPIPE:
     retval = "Error writing: receiving end cannot read"; break;
+  case SERIAL_DEVICE_ERR_STOPPED:
+    retval = "Stream reader has stopped"; break;
+  case SERIAL_DEVICE_ERR_THREAD:
+    retval = "Could not start reader thread"; break;
+  case SERIAL_DEVICE_ERR_STUCK:
+    retval = "Device stopped sending before all bytes arrived"; break;
+  case SERIAL_DEVICE_ERR_SHARED:
+    retval = "Device is already shared with different settings"; break;
+  case SERIAL_DEVICE_ERR_BUSY:
+    retval = "Device is in use by a stream or control loop"; break;
+  case SERIAL_DEVICE_ERR_CLOSED:
+    retval = "Device is closed"; break;
+  case SERIAL_DEVICE_ERR_MEMORY:
+    retval = "Out of memory"; break;
 
   default:
     retval = "Unknown error.";
@@ -83,6 +131,63 @@ int sd_baud_lookup(int baudrate) {
   return retval;
 }
 
+/**
+ * Reverse of sd_baud_lookup
+ */
+int sd_baud_rate(int control) {
+  static const int rates[] = {
+    50, 75, 110, 134, 150, 200, 300, 600, 1200, 1800, 2400,
+    4800, 9600, 19200, 38400, 57600, 115200, 230400
+  };
+  unsigned int i;
+
+  for (i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+    if (sd_baud_lookup(rates[i]) == control) {
+      return rates[i];
+    }
+  }
+  return 0;
+}
+
+/**
+ * Start bit, data bits, parity and stop bits at the device's rate
+ */
+unsigned long long sd_char_time_ns(SERIAL_DEVICE sd)
+{
+  int rate = sd_baud_rate(sd->baudrate);
+  int bits = 1 + sd->data_bits + sd->stop_bits
+    + (SERIAL_DEVICE_PARITY_NONE == sd->parity ? 0 : 1);
+
+  if (0 == rate) {
+    return 0;
+  }
+  return 1000000000ULL * bits / rate;
+}
+
+/**
+ * Fill in a stamp for a chunk that read() just returned.
+ * The last byte arrived no later than now and every byte behind it,
+ * in this chunk or still queued, took a character time.
+ * Stamps use the trace clock so chunks line up with the trace.
+ */
+static void sd_stamp_chunk(SERIAL_DEVICE sd, SD_CHUNK_STAMP *stamp, int offset, int length)
+{
+  int queued = 0;
+  unsigned long long behind;
+
+  stamp->ts_ns = sd_trace_now();
+  if (0 > ioctl(sd->fd, TIOCINQ, &queued)) {
+    queued = 0;
+  }
+
+  stamp->offset = offset;
+  stamp->length = length;
+  stamp->queued = queued;
+
+  behind = (unsigned long long)(length + queued) * sd_char_time_ns(sd);
+  stamp->first_ns = behind < stamp->ts_ns ? stamp->ts_ns - behind : 0;
+}
+
 
 /**
  * Send a message to the serial device
@@ -112,80 +217,176 @@ int sd_send_message(SERIAL_DEVICE sd, string_t message)
  * No error tracking either.
  */
 int sd_read_nbytes(SERIAL_DEVICE sd, int n_bytes, char *data) 
+{
+  return sd_read_nbytes_stamped(sd, n_bytes, data, NULL);
+}
+
+/**
+ * Wait up to ms for input on fd.  A signal is not a device error, so
+ * an interrupted select carries on with whatever time was left.
+ * @returns select's result
+ */
+static int sd_wait_readable(int fd, int ms)
+{
+  unsigned long long deadline = sd_trace_now() + (unsigned long long)ms * 1000000ULL;
+  unsigned long long now, left = (unsigned long long)ms * 1000000ULL;
+  struct timeval timeout;
+  fd_set fds;
+  int ready;
+
+  while (1) {
+    FD_ZERO(&fds);
+    FD_SET(fd, &fds);
+    timeout.tv_sec = left / 1000000000ULL;
+    timeout.tv_usec = (left % 1000000000ULL) / 1000;
+
+    ready = select(fd+1, &fds, NULL, NULL, &timeout);
+    if (0 <= ready || EINTR != errno) {
+      return ready;
+    }
+    now = sd_trace_now();
+    if (now >= deadline) {
+      return 0;
+    }
+    left = deadline - now;
+  }
+}
+
+/**
+ * Read up to n bytes, stamping the chunk if stamp is not NULL
+ */
+int sd_read_nbytes_stamped(SERIAL_DEVICE sd, int n_bytes, char *data, SD_CHUNK_STAMP *stamp)
 {
   if (NULL == sd) {
     return -1;
   }
+  if (0 > sd->fd) {
+    errno = EBADF;
+    return -1;
+  }
 
   int fd = sd->fd;
   int n;
   int ready = 1;
-  fd_set fds;
-  struct timeval timeout;
+  unsigned long long start = sd_trace_enabled ? sd_trace_now() : 0;
 
 
-  // Setup fd_set
-  FD_ZERO(&fds);
-  FD_SET(fd, &fds);
-
-  // Set 10 milli-second timeout
-  timeout.tv_sec = 0;
-  timeout.tv_usec = 10 * 1000;
-  
-  /* Wait for data to be ready */
-  ready = select(fd+1, &fds, NULL, NULL, &timeout) ;
+  /* Wait up to 10 milli-seconds for data to be ready */
+  ready = sd_wait_readable(fd, 10);
   
   if ( 0 < ready) {
     n =  read(fd, data, n_bytes);
+    if (NULL != stamp && 0 < n) {
+      sd_stamp_chunk(sd, stamp, 0, n);
+    }
   } else {
     n = 0;
   }
+
+  /* Polling with nothing to show is not worth a trace event */
+  if (sd_trace_enabled && 0 < n) {
+    sd_trace_record(sd, SD_TRACE_READ_BYTES, SD_TRACE_COMPLETE, NULL, n, start);
+  } else if (0 > n || 0 > ready) {
+    SD_TRACE(sd, SD_TRACE_ERROR, SD_TRACE_INSTANT, NULL, SERIAL_DEVICE_ERR_READ);
+  }
 		
   return n;
 
 }
 
+/**
+ * Drop unread input
+ */
+void sd_flush_input(SERIAL_DEVICE sd)
+{
+  if (NULL != sd && 0 <= sd->fd) {
+    tcflush(sd->fd, TCIFLUSH);
+  }
+}
+
 /**
  * Issue a command to the pilot.
  * Return errno or 0
  */
 int sd_read(SERIAL_DEVICE sd) 
 {
+  return sd_read_timeout(sd, 100, 100);
+}
+
+/**
+ * Read a response, waiting first_ms for it to start and
+ * then until the device has been idle for idle_ms.
+ * Return errno or 0
+ */
+int sd_read_timeout(SERIAL_DEVICE sd, int first_ms, int idle_ms)
+{
+  return sd_read_common(sd, first_ms, idle_ms, NULL, 0, NULL);
+}
+
+/**
+ * sd_read with a stamp per chunk
+ */
+int sd_read_stamped(SERIAL_DEVICE sd, SD_CHUNK_STAMP *stamps, int max_stamps, int *n_stamps)
+{
+  return sd_read_common(sd, 100, 100, stamps, max_stamps, n_stamps);
+}
+
+/**
+ * Shared body of the sd_read variants
+ */
+static int sd_read_common(SERIAL_DEVICE sd, int first_ms, int idle_ms, SD_CHUNK_STAMP *stamps, int max_stamps, int *n_stamps)
+{
+  int n_raw = 0;
+
+  if (NULL != n_stamps) {
+    *n_stamps = 0;
+  }
+  if (NULL == sd) {
+    return SERIAL_DEVICE_ERR_NULL;
+  }
+  if (0 > sd->fd) {
+    sd->last_response[0] = '\0';
+    return SERIAL_DEVICE_ERR_CLOSED;
+  }
+
   int fd = sd->fd;
   int err = SERIAL_DEVICE_OK;
   int n;
   int n_tot = 0;
   int ready = 1;
   int maxtimes = 100;
-  fd_set fds;
-  struct timeval timeout;
   char buf[BUFSIZE];
 
   if (NULL == sd) {
     err = SERIAL_DEVICE_ERR_NULL;
   }
+  SD_TRACE(sd, SD_TRACE_READ, SD_TRACE_BEGIN, NULL, 0);
 	
   // Repeatedly read data until select times out
   while (0 < ready && SERIAL_DEVICE_OK == err && 0 < maxtimes-- )  {
 
-    // Setup fd_set
-    FD_ZERO(&fds);
-    FD_SET(fd, &fds);
-
-    // Set 100 milli-second timeout
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 100 * 1000;
-		
-    /* Wait for data to be ready */
-    ready = select(fd+1, &fds, NULL, NULL, &timeout) ;
+    // Wait longer for the first byte than for the gap between bytes
+    ready = sd_wait_readable(fd, (0 == n_tot) ? first_ms : idle_ms);
 
     if ( 0 < ready) {
       n =  read(fd, buf, BUFSIZE);
+      if (0 > n && (EINTR == errno || EAGAIN == errno)) {
+	n = 0;
+      }
+      if (0 < n && NULL != stamps && *n_stamps < max_stamps) {
+	sd_stamp_chunk(sd, &stamps[(*n_stamps)++], n_raw, n);
+      }
+      if (0 < n) {
+	n_raw += n;
+      }
       if ( 0 > n) {
 	// Error in read
 	err = SERIAL_DEVICE_ERR_READ;
       } else if (0 < n && ((n_tot + n) < BUFSIZE)) {
 	// Append n bytes to return buffer, watch out for overflow
+	if (0 == n_tot) {
+	  SD_TRACE(sd, SD_TRACE_FIRST_BYTE, SD_TRACE_INSTANT, NULL, n);
+	}
 	memcpy(sd->last_response + n_tot, buf, n);
 	n_tot += n;
       }
@@ -197,6 +398,13 @@ int sd_read(SERIAL_DEVICE sd)
     err = SERIAL_DEVICE_ERR_SELECT;
   }
 
+  if (SERIAL_DEVICE_OK != err) {
+    SD_TRACE(sd, SD_TRACE_ERROR, SD_TRACE_INSTANT, NULL, err);
+  } else if (0 == n_tot) {
+    SD_TRACE(sd, SD_TRACE_TIMEOUT, SD_TRACE_INSTANT, NULL, first_ms);
+  }
+  SD_TRACE(sd, SD_TRACE_READ, SD_TRACE_END, NULL, n_tot);
+
   /* Terminate String */
   sd->last_response[n_tot] = '\0';	 
 	
@@ -227,6 +435,13 @@ int sd_read(SERIAL_DEVICE sd)
  */
 int sd_write(SERIAL_DEVICE sd, const  string_t command) 
 {
+  if (NULL == sd) {
+    return SERIAL_DEVICE_ERR_NULL;
+  }
+  if (0 > sd->fd) {
+    return SERIAL_DEVICE_ERR_CLOSED;
+  }
+
   int fd = sd->fd;
   int err = SERIAL_DEVICE_OK;
   int n, i;
@@ -255,16 +470,23 @@ int sd_write(SERIAL_DEVICE sd, const  string_t command)
 /*       err = SERIAL_DEVICE_ERR_WRITE; */
 /*   } */
   
+  SD_TRACE(sd, SD_TRACE_WRITE, SD_TRACE_BEGIN, command, size);
+
   for (i = 0; i < size && SERIAL_DEVICE_OK == err; i++) {
     c = command[i];
-    n =  write(fd, &c, 1);
+    do {
+      n =  write(fd, &c, 1);
+    } while (0 > n && EINTR == errno);
     if (1  != n) {
       err = SERIAL_DEVICE_ERR_WRITE;
     }
   }
   if (SERIAL_DEVICE_OK == err) {
     c = 13;
-    if (1 != write(fd, &c, 1)) {
+    do {
+      n = write(fd, &c, 1);
+    } while (0 > n && EINTR == errno);
+    if (1 != n) {
       err = SERIAL_DEVICE_ERR_WRITE;
     }
   }
@@ -297,6 +519,11 @@ int sd_write(SERIAL_DEVICE sd, const  string_t command)
     }
   }
 
+  if (SERIAL_DEVICE_OK != err) {
+    SD_TRACE(sd, SD_TRACE_ERROR, SD_TRACE_INSTANT, NULL, err);
+  }
+  SD_TRACE(sd, SD_TRACE_WRITE, SD_TRACE_END, NULL, err);
+
   return err;
 }
 
@@ -313,6 +540,7 @@ SERIAL_DEVICE sd_init(char *device)
 SERIAL_DEVICE sd_initWithDevice_baudrate_dataBits_stopBits_parity_flowControl(char *device, int baudrate, int data, int stop, int parity, int flow_control) 
 {
 
+  struct termios verify;
   int cflags = CREAD;
   int oflags = 0;
   int iflags = IGNPAR;
@@ -354,11 +582,23 @@ SERIAL_DEVICE sd_initWithDevice_baudrate_dataBits_stopBits_parity_flowControl(ch
   if (0 < fd) {
 
     sd->fd = fd;
+    sd->refcount = 1;
+    sd->shared = 0;
+    sd->claimed = 0;
+    sd->restore = 1;
+    sd->next = NULL;
+    sd->device = strdup(device);
+    sd->baudrate = baudrate;
+    sd->data_bits = data;
+    sd->stop_bits = stop;
+    sd->parity = parity;
+    sd->flow_control = flow_control;
     sd->oldtio = malloc(sizeof(struct termios));
     sd->tio = malloc(sizeof(struct termios));
     sd->last_response = (char *)malloc(sizeof(char)*BUFSIZE);
 		
     tcgetattr(fd, sd->oldtio);
+    *sd->tio = *sd->oldtio;
 		
     /* 
        BAUDRATE: Set bps rate. You could also use cfsetispeed and cfsetospeed.
@@ -372,6 +612,32 @@ SERIAL_DEVICE sd_initWithDevice_baudrate_dataBits_stopBits_parity_flowControl(ch
        A read will return when at least 1 byte of data is available or after 0.1*VTIME seconds expire
     */
     cfmakeraw(sd->tio);
+#ifdef __linux__
+    /*
+      The speed lives in c_cflag on linux, so it has to be set after the
+      flags.  That lets us apply the settings once, or not at all if the
+      port is already configured, and then check the driver took the speed.
+    */
+    sd->tio->c_cflag = cflags;
+    sd->tio->c_oflag = oflags;
+    sd->tio->c_iflag = iflags;
+    sd->tio->c_cc[VMIN] = 0;
+    sd->tio->c_cc[VTIME] = 0;
+    cfsetspeed(sd->tio, baudrate);
+
+    if ( sd_termios_equal(sd->oldtio, sd->tio) ) {
+      /* Already configured, only drop what arrived before we opened */
+      tcflush(fd, TCIFLUSH);
+    } else {
+      tcflush(fd, TCIOFLUSH);
+      if ( 0 > tcsetattr(fd, TCSANOW, sd->tio)
+	   || 0 > tcgetattr(fd, &verify)
+	   || cfgetospeed(&verify) != (speed_t)baudrate ) {
+	sd_destroy(sd);
+	return NULL;
+      }
+    }
+#else
     cfsetspeed(sd->tio, baudrate);
     sd->tio->c_cflag = cflags;
     sd->tio->c_oflag = oflags;
@@ -396,6 +662,7 @@ SERIAL_DEVICE sd_initWithDevice_baudrate_dataBits_stopBits_parity_flowControl(ch
       sd_destroy(sd);
       return NULL;
     }
+#endif
 		
   } else {
     free(sd);
@@ -405,27 +672,220 @@ SERIAL_DEVICE sd_initWithDevice_baudrate_dataBits_stopBits_parity_flowControl(ch
   return sd;
 }
 
+/**
+ * Unlink a shared device from the registry.  Call with the lock held.
+ */
+static void sd_registry_remove(SERIAL_DEVICE sd)
+{
+  SERIAL_DEVICE *p;
+
+  for (p = &sd_registry; NULL != *p; p = &(*p)->next) {
+    if (*p == sd) {
+      *p = sd->next;
+      break;
+    }
+  }
+  sd->next = NULL;
+  sd->shared = 0;
+}
+
+/**
+ * Find a shared device by path.  Call with the lock held.
+ */
+static SERIAL_DEVICE sd_registry_find(char *path)
+{
+  SERIAL_DEVICE sd;
+
+  for (sd = sd_registry; NULL != sd; sd = sd->next) {
+    if (0 == strcmp(sd->device, path)) {
+      break;
+    }
+  }
+  return sd;
+}
+
+/**
+ * Take a reference on a registered device if its settings match.
+ * Call with the lock held.
+ */
+static SERIAL_DEVICE sd_registry_share(SERIAL_DEVICE sd, int baudrate, int data, int stop, int parity, int flow_control, int *err)
+{
+  if (sd->baudrate == baudrate && sd->data_bits == data && sd->stop_bits == stop
+      && sd->parity == parity && sd->flow_control == flow_control) {
+    sd->refcount++;
+    return sd;
+  }
+  *err = SERIAL_DEVICE_ERR_SHARED;
+  return NULL;
+}
+
+/**
+ * Return the shared handle for a device, opening it on first use.
+ * The lookup and the open happen under sd_open_lock: a second open
+ * racing the first would flush, and on close restore, the port under
+ * the handle that won.
+ */
+SERIAL_DEVICE sd_open_shared(char *device, int baudrate, int data, int stop, int parity, int flow_control, int *err)
+{
+  SERIAL_DEVICE sd;
+  char path[PATH_MAX];
+
+  *err = SERIAL_DEVICE_OK;
+
+  /* Symlinks such as /dev/serial/by-id/... share with the real node */
+  if (NULL == realpath(device, path)) {
+    strncpy(path, device, PATH_MAX - 1);
+    path[PATH_MAX - 1] = '\0';
+  }
+
+  pthread_mutex_lock(&sd_open_lock);
+
+  pthread_mutex_lock(&sd_registry_lock);
+  sd = sd_registry_find(path);
+  if (NULL != sd) {
+    sd = sd_registry_share(sd, baudrate, data, stop, parity, flow_control, err);
+    pthread_mutex_unlock(&sd_registry_lock);
+    pthread_mutex_unlock(&sd_open_lock);
+    return sd;
+  }
+  pthread_mutex_unlock(&sd_registry_lock);
+
+  /* Nobody else can be opening it meanwhile */
+  sd = sd_initWithDevice_baudrate_dataBits_stopBits_parity_flowControl(path, baudrate, data, stop, parity, flow_control);
+  if (NULL == sd) {
+    *err = SERIAL_DEVICE_ERR_NULL;
+  } else {
+    pthread_mutex_lock(&sd_registry_lock);
+    sd->shared = 1;
+    sd->next = sd_registry;
+    sd_registry = sd;
+    pthread_mutex_unlock(&sd_registry_lock);
+  }
+
+  pthread_mutex_unlock(&sd_open_lock);
+  return sd;
+}
+
 /**
  * Close file descripter and reset attributes
  * doesn't free memory
+ * A shared device stays open while anyone else holds it.
+ * Refuses while a stream or control loop is using it.
  */
-void sd_close(SERIAL_DEVICE sd) 
+int sd_close(SERIAL_DEVICE sd) 
 {
-  if (NULL != sd && 0 < sd->fd) {
-    tcflush(sd->fd, TCIOFLUSH);
-    tcsetattr(sd->fd, TCSANOW, sd->oldtio);
+  if (NULL == sd) {
+    return SERIAL_DEVICE_ERR_NULL;
+  }
+
+  pthread_mutex_lock(&sd_registry_lock);
+  if (0 != sd->claimed) {
+    pthread_mutex_unlock(&sd_registry_lock);
+    return SERIAL_DEVICE_ERR_BUSY;
+  }
+  if (sd->shared) {
+    if (1 < sd->refcount) {
+      pthread_mutex_unlock(&sd_registry_lock);
+      return SERIAL_DEVICE_OK;
+    }
+    sd_registry_remove(sd);
+  }
+  pthread_mutex_unlock(&sd_registry_lock);
+
+  if (0 <= sd->fd) {
+    if ( sd->restore && !sd_termios_equal(sd->oldtio, sd->tio) ) {
+      tcflush(sd->fd, TCIOFLUSH);
+      tcsetattr(sd->fd, TCSANOW, sd->oldtio);
+    }
     close(sd->fd);
-    sd->fd = 0;
+    sd->fd = -1;
+  }
+  return SERIAL_DEVICE_OK;
+}
+
+/**
+ * Claim part of a device for a background thread
+ */
+int sd_claim(SERIAL_DEVICE sd, int what)
+{
+  int err = SERIAL_DEVICE_OK;
+
+  if (NULL == sd) {
+    return SERIAL_DEVICE_ERR_NULL;
+  }
+  pthread_mutex_lock(&sd_registry_lock);
+  if (0 > sd->fd) {
+    err = SERIAL_DEVICE_ERR_CLOSED;
+  } else if (0 != (sd->claimed & what)) {
+    err = SERIAL_DEVICE_ERR_BUSY;
+  } else {
+    sd->claimed |= what;
+  }
+  pthread_mutex_unlock(&sd_registry_lock);
+
+  return err;
+}
+
+/**
+ * Release a claim
+ */
+void sd_unclaim(SERIAL_DEVICE sd, int what)
+{
+  if (NULL != sd) {
+    pthread_mutex_lock(&sd_registry_lock);
+    sd->claimed &= ~what;
+    pthread_mutex_unlock(&sd_registry_lock);
+  }
+}
+
+/**
+ * Keep or drop the original attributes on close
+ */
+void sd_set_restore(SERIAL_DEVICE sd, int restore)
+{
+  if (NULL != sd) {
+    pthread_mutex_lock(&sd_registry_lock);
+    sd->restore = restore;
+    pthread_mutex_unlock(&sd_registry_lock);
   }
 }
 
+/**
+ * Take another reference on a SERIAL_DEVICE
+ */
+SERIAL_DEVICE sd_retain(SERIAL_DEVICE sd)
+{
+  if (NULL != sd) {
+    pthread_mutex_lock(&sd_registry_lock);
+    sd->refcount++;
+    pthread_mutex_unlock(&sd_registry_lock);
+  }
+  return sd;
+}
+
 /**
  * Free resources consumed by a SERIAL_DEVICE 
+ * once the last reference is released
  */
 void sd_destroy(SERIAL_DEVICE sd) 
 {
+  int remaining;
+
+  if (NULL == sd) {
+    return;
+  }
+  pthread_mutex_lock(&sd_registry_lock);
+  remaining = --sd->refcount;
+  if (0 == remaining && sd->shared) {
+    sd_registry_remove(sd);
+  }
+  pthread_mutex_unlock(&sd_registry_lock);
+  if (0 < remaining) {
+    return;
+  }
   if (NULL != sd) { 
     sd_close(sd);
+    free(sd->device);
     free(sd->oldtio);
     free(sd->tio);
     free(sd->last_response);
@@ -22,22 +22,54 @@
 #define SERIAL_DEVICE_ERR_WRITE_ENOSPC -13
 #define SERIAL_DEVICE_ERR_WRITE_EPIPE -14
 
+#define SERIAL_DEVICE_ERR_STOPPED -15
+#define SERIAL_DEVICE_ERR_THREAD -16
+#define SERIAL_DEVICE_ERR_STUCK -17
+#define SERIAL_DEVICE_ERR_SHARED -18
+#define SERIAL_DEVICE_ERR_BUSY -19
+#define SERIAL_DEVICE_ERR_CLOSED -20
+#define SERIAL_DEVICE_ERR_MEMORY -21
+
 
 #define SERIAL_DEVICE_PARITY_EVEN 2
 #define SERIAL_DEVICE_PARITY_ODD 1
 #define SERIAL_DEVICE_PARITY_NONE 0
 
+/** What a background thread owns on a device, see sd_claim */
+#define SD_CLAIM_READ 1
+#define SD_CLAIM_WRITE 2
+
 // The SERIAL_DEVICE Data Type
-typedef struct {
+typedef struct SERIAL_DEVICE_T {
 	int fd;
 	struct termios* oldtio;
 	struct termios* tio;
 	char *last_response;
+	int refcount;
+	char *device;
+	int baudrate;
+	int data_bits;
+	int stop_bits;
+	int parity;
+	int flow_control;
+	int shared;
+	int claimed;   /* SD_CLAIM_* held by running streams and control loops */
+	int restore;   /* put the original attributes back on close */
+	struct SERIAL_DEVICE_T *next;
 } SERIAL_DEVICE_T;
 
 // Pointer to the data type
 typedef SERIAL_DEVICE_T* SERIAL_DEVICE;
 
+// When one read() chunk arrived
+typedef struct {
+	unsigned long long ts_ns;     /* sd_trace_now() just after read() returned */
+	unsigned long long first_ns;  /* estimated start of the chunk's first byte on the wire */
+	int offset;                   /* where the chunk starts among the bytes read */
+	int length;
+	int queued;                   /* bytes still waiting in the tty (TIOCINQ) */
+} SD_CHUNK_STAMP;
+
 // Define a string type for readability
 typedef char* string_t;
 
@@ -47,6 +79,12 @@ char *sd_errstring(int err);
 /** Lookup the baudrate control integer for the given rate */
 int sd_baud_lookup(int baudrate);
 
+/** Bits per second for a baudrate control integer, the reverse of sd_baud_lookup */
+int sd_baud_rate(int control);
+
+/** Nanoseconds one character takes on the wire with the device's framing */
+unsigned long long sd_char_time_ns(SERIAL_DEVICE sd);
+
 /**
  * Query the device. Resopnse is inserted in sd->last_response
  * @param sd The SERIAL_DEVICE type as returned by sd_init
@@ -62,12 +100,39 @@ int sd_send_message(SERIAL_DEVICE sd, string_t message);
  */ 
 int sd_read(SERIAL_DEVICE sd);
 
+/**
+ * Like sd_read, but wait up to first_ms for the response to start
+ * and stop once no byte has arrived for idle_ms.  sd_read uses 100/100.
+ * @returns SERIAL_DEVICE_OK on success, an empty response on timeout
+ */
+int sd_read_timeout(SERIAL_DEVICE sd, int first_ms, int idle_ms);
+
+/**
+ * sd_read that also stamps each read() chunk as it arrives.
+ * Offsets count raw bytes received, before the response is trimmed.
+ * @param stamps receives up to max_stamps entries
+ * @param n_stamps set to the number of entries filled in
+ */
+int sd_read_stamped(SERIAL_DEVICE sd, SD_CHUNK_STAMP *stamps, int max_stamps, int *n_stamps);
+
 /**
  * Read up to n bytes from the serial device into the buffer.
  * @return the number of bytes actually read
  */
 int sd_read_nbytes(SERIAL_DEVICE sd, int n, char *buf);
 
+/**
+ * sd_read_nbytes that also stamps the chunk, if any bytes were read.
+ * stamp->offset is always 0.
+ */
+int sd_read_nbytes_stamped(SERIAL_DEVICE sd, int n, char *buf, SD_CHUNK_STAMP *stamp);
+
+/**
+ * Discard anything received but not yet read, i.e. the tail of a
+ * reply that arrived after it was given up on
+ */
+void sd_flush_input(SERIAL_DEVICE sd);
+
 /**
  * Write a command to the pilot
  * @param sd The SERIAL_DEVICE as returned by sd_init
@@ -86,8 +151,56 @@ SERIAL_DEVICE sd_init(char *device);
 
 SERIAL_DEVICE sd_initWithDevice_baudrate_dataBits_stopBits_parity_flowControl(char *device, int baudrate, int dataBits, int stopBits, int parity, int flow_control);
 
+/**
+ * Open a device through the process wide registry.  If the device is
+ * already open with the same settings the configured handle is returned
+ * with an extra reference, keeping the fd and its buffers warm.
+ * Release with sd_destroy.
+ * @param err set to SERIAL_DEVICE_ERR_SHARED if the settings differ
+ * @returns NULL on error
+ */
+SERIAL_DEVICE sd_open_shared(char *device, int baudrate, int dataBits, int stopBits, int parity, int flow_control, int *err);
+
+/**
+ * Close the file descriptor and restore the original attributes,
+ * unless sd_set_restore turned that off.
+ * Memory is not freed until sd_destroy.  A shared device is only
+ * closed by its last holder.
+ * @returns SERIAL_DEVICE_OK or SERIAL_DEVICE_ERR_BUSY while a
+ * stream or control loop is using the device
+ */
+int sd_close(SERIAL_DEVICE sd);
+
+/**
+ * Mark part of the device as owned by a background thread so it
+ * cannot be closed, or claimed again, underneath it.
+ * @param what SD_CLAIM_* flags
+ * @returns SERIAL_DEVICE_OK, SERIAL_DEVICE_ERR_BUSY if any of what is
+ * already claimed or SERIAL_DEVICE_ERR_CLOSED
+ */
+int sd_claim(SERIAL_DEVICE sd, int what);
+
+/**
+ * Give up a claim taken with sd_claim
+ */
+void sd_unclaim(SERIAL_DEVICE sd, int what);
+
+/**
+ * Choose whether sd_close puts the port back as it was found (the
+ * default) or leaves it configured, so the next open can skip
+ * reconfiguring it.
+ */
+void sd_set_restore(SERIAL_DEVICE sd, int restore);
+
+/**
+ * Take an additional reference on the device, i.e. for a stream
+ * reader that must outlive the Ruby object.  Balance with sd_destroy.
+ */
+SERIAL_DEVICE sd_retain(SERIAL_DEVICE sd);
+
 /**
  * Close the communication port with the pilot
+ * Resources are released when the last reference is dropped.
  * @param pilot The pilot type as returned by pilot_init
  */
 void sd_destroy(SERIAL_DEVICE sd);
@@ -0,0 +1,96 @@
+#
+# serial_device_discovery.rb
+#
+# Find which instrument is on which serial port without hard coding
+# /dev/ttyUSB0 vs /dev/ttyS0.  Ports are probed concurrently in c by
+# SerialDevice.probe, results can be cached on disk between runs.
+# Discovery can be interrupted with Ctrl-C.
+#
+require 'RbSerialDevice'
+require 'yaml'
+
+class SerialDevice
+
+  # Probe commands tried on every port, in order.
+  # *IDN? for the pilot, IDN for the M6812 board.
+  DISCOVERY_PROFILES = [
+    {:baud => 57600, :probe => "*IDN?"},
+    {:baud => 57600, :probe => "IDN"}
+  ]
+
+  class << self
+
+    # Return a hash of identity string => array of options for
+    # SerialDevice.new ({:device, :baud, :probe}), one per port that
+    # answered a probe with that identity.  Identical instruments, such
+    # as a rack of M6812 boards, share an identity and are listed in
+    # port order.
+    #
+    # Recognized options
+    #   :ports,    glob pattern or array of device paths.
+    #              Default is every port listed in /sys/class/tty
+    #   :profiles, array of {:baud, :probe}. Default DISCOVERY_PROFILES
+    #   :timeout,  seconds to wait for each reply, default 0.5
+    #   :cache,    file to remember the result in.  A cached result is
+    #              returned without probing while all its ports exist
+    #   :refresh,  true to ignore the cache, after moving instruments
+    #
+    # ex.
+    #    found = SerialDevice.discover(:cache => "/tmp/instruments.yml")
+    #    pilot = Pilot.new(found.find {|id, ports| id =~ /pilot/i }[1].first)
+    def discover(options = {})
+      profiles = options[:profiles] || DISCOVERY_PROFILES
+      timeout = options[:timeout] || 0.5
+      cache = options[:cache]
+
+      if cache and not options[:refresh]
+        found = load_discovery_cache(cache)
+        return found if found
+      end
+
+      found = {}
+      probe(discovery_ports(options[:ports]), profiles, timeout).each do |entry|
+        (found[entry.delete(:identity)] ||= []) << entry
+      end
+
+      File.open(cache, 'w') {|f| f.write(found.to_yaml) } if cache
+      found
+    end
+
+    # Candidate device paths.  /sys/class/tty lists every tty, only
+    # those backed by a device are real ports.
+    def discovery_ports(ports = nil)
+      case ports
+      when Array then ports
+      when String then Dir.glob(ports).sort
+      else
+        sys = Dir.glob("/sys/class/tty/*/device").map {|d| "/dev/" + File.basename(File.dirname(d)) }
+        sys = Dir.glob("/dev/tty{USB,ACM,S}*") if sys.empty?
+        sys.select {|d| File.exist?(d) }.sort
+      end
+    end
+
+    # The cached result, or nil unless it is readable and every port
+    # in it still exists.  Nothing is probed.
+    def load_discovery_cache(cache)
+      return nil unless File.exist?(cache)
+      cached = safe_load_yaml(File.read(cache)) rescue nil
+      return nil unless cached.is_a?(Hash) and not cached.empty?
+      return nil unless cached.values.all? {|ports| ports.is_a?(Array) and ports.all? {|opts| opts.is_a?(Hash) } }
+
+      cached.values.flatten.all? {|opts| File.exist?(opts[:device].to_s) } ? cached : nil
+    end
+
+    # YAML.safe_load allowing the symbol keys we write.  Psych before
+    # 3.1 takes the permitted classes as a positional argument.
+    def safe_load_yaml(text)
+      if YAML.method(:safe_load).parameters.include?([:key, :permitted_classes])
+        YAML.safe_load(text, :permitted_classes => [Symbol])
+      else
+        YAML.safe_load(text, [Symbol])
+      end
+    end
+
+  end
+
+end
@@ -0,0 +1,157 @@
+/*
+ * Discovery of instruments by probing serial ports concurrently
+ * for their identity.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "serial_discover.h"
+
+/* Once a reply has started it is complete after this much silence */
+#define SD_PROBE_IDLE_MS 20
+
+// Work handed to each probing thread
+typedef struct {
+	SD_PROBE_PROFILE *profiles;
+	int n_profiles;
+	int deadline_ms;
+	SD_PROBE_RESULT *result;
+	volatile int *cancel;
+} SD_PROBE_JOB_T;
+
+/**
+ * Trim a reply to the identity, sd_read leaves CRs in place
+ */
+static void sd_probe_trim(char *response)
+{
+  char *start = response;
+  int n;
+
+  while (' ' == *start || '\r' == *start || '\n' == *start) {
+    start++;
+  }
+  memmove(response, start, strlen(start) + 1);
+  n = strlen(response);
+  while (0 < n && (' ' == response[n - 1] || '\r' == response[n - 1] || '\n' == response[n - 1])) {
+    response[--n] = '\0';
+  }
+}
+
+/**
+ * Ask a single port for its identity
+ */
+int sd_probe(char *device, SD_PROBE_PROFILE *profile, int deadline_ms, char *response, int size, volatile int *cancel)
+{
+  SERIAL_DEVICE sd;
+  int err, waited, slice;
+
+  response[0] = '\0';
+  sd = sd_initWithDevice_baudrate_dataBits_stopBits_parity_flowControl(device,
+								      sd_baud_lookup(profile->baudrate),
+								      8, 1,
+								      SERIAL_DEVICE_PARITY_NONE,
+								      0);
+  if (NULL == sd) {
+    return SERIAL_DEVICE_ERR_NULL;
+  }
+
+  err = sd_write(sd, profile->probe);
+
+  /* Wait for the reply in slices so a cancel is noticed */
+  sd->last_response[0] = '\0';
+  for (waited = 0; SERIAL_DEVICE_OK == err && waited < deadline_ms; waited += slice) {
+    if (NULL != cancel && *cancel) {
+      break;
+    }
+    slice = deadline_ms - waited < SD_PROBE_SLICE_MS ? deadline_ms - waited : SD_PROBE_SLICE_MS;
+    err = sd_read_timeout(sd, slice, SD_PROBE_IDLE_MS);
+    if ('\0' != sd->last_response[0]) {
+      break;
+    }
+  }
+  if (SERIAL_DEVICE_OK == err) {
+    strncpy(response, sd->last_response, size - 1);
+    response[size - 1] = '\0';
+    sd_probe_trim(response);
+  }
+
+  sd_destroy(sd);
+  return err;
+}
+
+/**
+ * Thread body, walks the profiles for one port
+ */
+static void *sd_discover_run(void *arg)
+{
+  SD_PROBE_JOB_T *job = (SD_PROBE_JOB_T *)arg;
+  SD_PROBE_RESULT *result = job->result;
+  int i;
+
+  result->profile = -1;
+  for (i = 0; i < job->n_profiles && !(NULL != job->cancel && *job->cancel); i++) {
+    result->err = sd_probe(result->device, &job->profiles[i], job->deadline_ms,
+			   result->response, SD_PROBE_RESPONSE_SIZE, job->cancel);
+    if (SERIAL_DEVICE_ERR_NULL == result->err) {
+      /* Port cannot be opened, other profiles will not help */
+      break;
+    }
+    if (SERIAL_DEVICE_OK == result->err && '\0' != result->response[0]) {
+      result->profile = i;
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Probe all ports at once
+ */
+int sd_discover(char **devices, int n_devices, SD_PROBE_PROFILE *profiles, int n_profiles, int deadline_ms, SD_PROBE_RESULT *results, volatile int *cancel)
+{
+  SD_PROBE_JOB_T *jobs;
+  pthread_t *threads;
+  int *started;
+  int i, err = SERIAL_DEVICE_OK;
+
+  jobs = (SD_PROBE_JOB_T *)calloc(n_devices, sizeof(SD_PROBE_JOB_T));
+  threads = (pthread_t *)calloc(n_devices, sizeof(pthread_t));
+  started = (int *)calloc(n_devices, sizeof(int));
+  if (NULL == jobs || NULL == threads || NULL == started) {
+    free(jobs);
+    free(threads);
+    free(started);
+    return SERIAL_DEVICE_ERR_THREAD;
+  }
+
+  for (i = 0; i < n_devices; i++) {
+    results[i].device = devices[i];
+    results[i].profile = -1;
+    results[i].err = SERIAL_DEVICE_OK;
+    results[i].response[0] = '\0';
+
+    jobs[i].profiles = profiles;
+    jobs[i].n_profiles = n_profiles;
+    jobs[i].deadline_ms = deadline_ms;
+    jobs[i].result = &results[i];
+    jobs[i].cancel = cancel;
+    if (0 == pthread_create(&threads[i], NULL, sd_discover_run, &jobs[i])) {
+      started[i] = 1;
+    } else {
+      /* Fall back to probing this port in line */
+      sd_discover_run(&jobs[i]);
+    }
+  }
+
+  for (i = 0; i < n_devices; i++) {
+    if (started[i]) {
+      pthread_join(threads[i], NULL);
+    }
+  }
+
+  free(jobs);
+  free(threads);
+  free(started);
+  return err;
+}
@@ -0,0 +1,45 @@
+#ifndef SERIAL_DISCOVER_H
+#define SERIAL_DISCOVER_H
+
+#include "serial_device.h"
+
+#define SD_PROBE_RESPONSE_SIZE 255
+
+/* How often a probe waiting for a reply checks whether it was cancelled */
+#define SD_PROBE_SLICE_MS 50
+
+// One way of asking an instrument who it is
+typedef struct {
+	int baudrate;
+	char *probe;
+} SD_PROBE_PROFILE;
+
+// Outcome of probing one port
+typedef struct {
+	char *device;
+	int profile;
+	int err;
+	char response[SD_PROBE_RESPONSE_SIZE];
+} SD_PROBE_RESULT;
+
+/**
+ * Open device at the profile's baud rate (8N1), send the probe command
+ * and read the reply, waiting at most deadline_ms for it to start.
+ * *cancel may be set from another thread to give up the wait early.
+ * @param response receives the reply trimmed of spaces, CR and LF,
+ * empty if nothing answered
+ * @returns SERIAL_DEVICE_OK, or an error if the port could not be used
+ */
+int sd_probe(char *device, SD_PROBE_PROFILE *profile, int deadline_ms, char *response, int size, volatile int *cancel);
+
+/**
+ * Probe every device concurrently, one thread per port.  Each port
+ * tries the profiles in order and stops at the first that answers.
+ * results[i].profile is the index of that profile, or -1 if none did.
+ * Setting *cancel from another thread stops every probe within
+ * SD_PROBE_SLICE_MS, leaving the ports not yet found at -1.
+ * @returns SERIAL_DEVICE_OK or SERIAL_DEVICE_ERR_THREAD
+ */
+int sd_discover(char **devices, int n_devices, SD_PROBE_PROFILE *profiles, int n_profiles, int deadline_ms, SD_PROBE_RESULT *results, volatile int *cancel);
+
+#endif
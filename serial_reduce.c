@@ -0,0 +1,333 @@
+/*
+ * Per-channel reduction and decimation of fixed length binary records
+ * while they are being read, so full resolution data never has to
+ * reach Ruby unless asked for.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <limits.h>
+#include "serial_reduce.h"
+
+/* Records gathered into a column before running the kernels */
+#define SD_REDUCE_BLOCK 256
+
+/* Empty reads tolerated before giving up, as in M6812#get_n_bytes */
+#define SD_ACQUIRE_MAX_TRIES 10
+
+#define SD_ACQUIRE_CHUNK 4096
+
+/**
+ * Create a reducer
+ */
+SD_REDUCER sd_reducer_new(int record_length, int decimate)
+{
+  SD_REDUCER r;
+
+  if (0 >= record_length || 0 > decimate) {
+    return NULL;
+  }
+
+  r = (SD_REDUCER)calloc(1, sizeof(SD_REDUCER_T));
+  if (NULL == r) {
+    return NULL;
+  }
+  r->partial = (unsigned char *)malloc(record_length);
+  if (NULL == r->partial) {
+    free(r);
+    return NULL;
+  }
+  r->record_length = record_length;
+  r->decimate = decimate;
+
+  return r;
+}
+
+/**
+ * Register a u16 column at the given byte offset
+ */
+int sd_reducer_add_field(SD_REDUCER r, int offset)
+{
+  SD_REDUCE_FIELD *f;
+
+  if (NULL == r || SD_REDUCE_MAX_FIELDS <= r->n_fields
+      || 0 > offset || offset + 2 > r->record_length) {
+    return SERIAL_DEVICE_ERR_NULL;
+  }
+
+  f = &r->fields[r->n_fields];
+  memset(f, 0, sizeof(SD_REDUCE_FIELD));
+  f->offset = offset;
+  f->min = 0xFFFF;
+
+  return r->n_fields++;
+}
+
+/**
+ * Append one decimated point, growing the output as needed
+ * @returns SERIAL_DEVICE_ERR_MEMORY, keeping what is there, if it cannot grow
+ */
+static int sd_reduce_emit(SD_REDUCE_FIELD *f, double value)
+{
+  double *grown;
+  int size;
+
+  if (f->n_decimated == f->decimated_size) {
+    if (INT_MAX / 2 < f->decimated_size) {
+      return SERIAL_DEVICE_ERR_MEMORY;
+    }
+    size = f->decimated_size ? 2 * f->decimated_size : 64;
+    grown = (double *)realloc(f->decimated, (size_t)size * sizeof(double));
+    if (NULL == grown) {
+      return SERIAL_DEVICE_ERR_MEMORY;
+    }
+    f->decimated = grown;
+    f->decimated_size = size;
+  }
+  f->decimated[f->n_decimated++] = value;
+  return SERIAL_DEVICE_OK;
+}
+
+/**
+ * Summary and decimation kernels over one contiguous column.
+ * The first loop is branch free so the compiler can vectorize it.
+ */
+static int sd_reduce_column(SD_REDUCE_FIELD *f, const unsigned short *col, int n, int decimate)
+{
+  unsigned long long sum = 0, sumsq = 0;
+  unsigned int lo = f->min, hi = f->max;
+  unsigned int v;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    v = col[i];
+    sum += v;
+    sumsq += (unsigned long long)v * v;
+    lo = v < lo ? v : lo;
+    hi = v > hi ? v : hi;
+  }
+  f->count += n;
+  f->sum += sum;
+  f->sumsq += sumsq;
+  f->min = lo;
+  f->max = hi;
+
+  if (0 < decimate) {
+    for (i = 0; i < n; i++) {
+      f->block_sum += col[i];
+      if (++f->block_n == decimate) {
+	if (SERIAL_DEVICE_OK != sd_reduce_emit(f, (double)f->block_sum / decimate)) {
+	  return SERIAL_DEVICE_ERR_MEMORY;
+	}
+	f->block_sum = 0;
+	f->block_n = 0;
+      }
+    }
+  }
+  return SERIAL_DEVICE_OK;
+}
+
+/**
+ * Reduce n complete records starting at data
+ */
+static int sd_reduce_records(SD_REDUCER r, const unsigned char *data, int n)
+{
+  unsigned short col[SD_REDUCE_BLOCK];
+  const unsigned char *p;
+  int rl = r->record_length;
+  int i, j, k, m;
+
+  for (i = 0; i < n; i += SD_REDUCE_BLOCK) {
+    m = n - i < SD_REDUCE_BLOCK ? n - i : SD_REDUCE_BLOCK;
+    for (j = 0; j < r->n_fields; j++) {
+      /* Gather the big-endian column, then reduce it contiguously */
+      p = data + (long)i * rl + r->fields[j].offset;
+      for (k = 0; k < m; k++) {
+	col[k] = (unsigned short)((p[0] << 8) | p[1]);
+	p += rl;
+      }
+      if (SERIAL_DEVICE_OK != sd_reduce_column(&r->fields[j], col, m, r->decimate)) {
+	return SERIAL_DEVICE_ERR_MEMORY;
+      }
+    }
+  }
+  r->records += n;
+  return SERIAL_DEVICE_OK;
+}
+
+/**
+ * Feed bytes, carrying a split record over to the next call
+ */
+int sd_reducer_feed(SD_REDUCER r, const unsigned char *data, int n)
+{
+  int rl, take, whole;
+
+  if (NULL == r || NULL == data) {
+    return SERIAL_DEVICE_ERR_NULL;
+  }
+  if (0 >= n) {
+    return SERIAL_DEVICE_OK;
+  }
+  rl = r->record_length;
+
+  if (0 < r->n_partial) {
+    take = rl - r->n_partial;
+    if (take > n) {
+      take = n;
+    }
+    memcpy(r->partial + r->n_partial, data, take);
+    r->n_partial += take;
+    data += take;
+    n -= take;
+    if (r->n_partial < rl) {
+      return SERIAL_DEVICE_OK;
+    }
+    r->n_partial = 0;
+    if (SERIAL_DEVICE_OK != sd_reduce_records(r, r->partial, 1)) {
+      return SERIAL_DEVICE_ERR_MEMORY;
+    }
+  }
+
+  whole = n / rl;
+  if (SERIAL_DEVICE_OK != sd_reduce_records(r, data, whole)) {
+    return SERIAL_DEVICE_ERR_MEMORY;
+  }
+
+  r->n_partial = n - whole * rl;
+  memcpy(r->partial, data + (long)whole * rl, r->n_partial);
+  return SERIAL_DEVICE_OK;
+}
+
+/**
+ * Emit the mean of any incomplete decimation block
+ */
+int sd_reducer_finish(SD_REDUCER r)
+{
+  SD_REDUCE_FIELD *f;
+  int j;
+
+  if (NULL == r) {
+    return SERIAL_DEVICE_ERR_NULL;
+  }
+  for (j = 0; j < r->n_fields; j++) {
+    f = &r->fields[j];
+    if (0 < f->block_n) {
+      if (SERIAL_DEVICE_OK != sd_reduce_emit(f, (double)f->block_sum / f->block_n)) {
+	return SERIAL_DEVICE_ERR_MEMORY;
+      }
+      f->block_sum = 0;
+      f->block_n = 0;
+    }
+  }
+  return SERIAL_DEVICE_OK;
+}
+
+/**
+ * Summary statistics of one field
+ */
+void sd_reducer_stats(SD_REDUCER r, int field, double *mean, unsigned int *min, unsigned int *max, double *rms)
+{
+  SD_REDUCE_FIELD *f = &r->fields[field];
+
+  if (0 == f->count) {
+    *mean = *rms = 0.0;
+    *min = *max = 0;
+    return;
+  }
+  *mean = (double)f->sum / f->count;
+  *rms = sqrt((double)f->sumsq / f->count);
+  *min = f->min;
+  *max = f->max;
+}
+
+/**
+ * Clear the statistics for another acquisition
+ */
+void sd_reducer_reset(SD_REDUCER r)
+{
+  SD_REDUCE_FIELD *f;
+  int j;
+
+  if (NULL == r) {
+    return;
+  }
+  for (j = 0; j < r->n_fields; j++) {
+    f = &r->fields[j];
+    f->count = f->sum = f->sumsq = 0;
+    f->min = 0xFFFF;
+    f->max = 0;
+    f->block_sum = 0;
+    f->block_n = 0;
+    f->n_decimated = 0;
+  }
+  r->n_partial = 0;
+  r->records = 0;
+}
+
+/**
+ * Free a reducer and its decimated columns
+ */
+void sd_reducer_free(SD_REDUCER r)
+{
+  int j;
+
+  if (NULL != r) {
+    for (j = 0; j < r->n_fields; j++) {
+      free(r->fields[j].decimated);
+    }
+    free(r->partial);
+    free(r);
+  }
+}
+
+/**
+ * Read a whole acquisition, reducing each chunk as it is read
+ */
+int sd_acquire_reduced(SERIAL_DEVICE sd, int n_bytes, SD_REDUCER r, char *raw)
+{
+  char chunk[SD_ACQUIRE_CHUNK];
+  char *buf;
+  int got = 0;
+  int tries = 0;
+  int want, n, err;
+
+  if (NULL == sd) {
+    return SERIAL_DEVICE_ERR_NULL;
+  }
+
+  while (got < n_bytes) {
+    want = n_bytes - got;
+    if (NULL != raw) {
+      buf = raw + got;
+    } else {
+      buf = chunk;
+      if (want > SD_ACQUIRE_CHUNK) {
+	want = SD_ACQUIRE_CHUNK;
+      }
+    }
+
+    n = sd_read_nbytes(sd, want, buf);
+    if (0 > n) {
+      if (EINTR != errno && EAGAIN != errno) {
+	return SERIAL_DEVICE_ERR_READ;
+      }
+      n = 0;
+    }
+
+    if (0 == n) {
+      if (SD_ACQUIRE_MAX_TRIES < ++tries) {
+	return SERIAL_DEVICE_ERR_STUCK;
+      }
+    } else {
+      tries = 0;
+      err = sd_reducer_feed(r, (unsigned char *)buf, n);
+      if (SERIAL_DEVICE_OK != err) {
+	return err;
+      }
+      got += n;
+    }
+  }
+
+  return sd_reducer_finish(r);
+}
@@ -0,0 +1,82 @@
+#ifndef SERIAL_REDUCE_H
+#define SERIAL_REDUCE_H
+
+#include "serial_device.h"
+
+#define SD_REDUCE_MAX_FIELDS 8
+
+// Running summary of one big-endian u16 column of a record stream
+typedef struct {
+	int offset;
+	unsigned long long count;
+	unsigned long long sum;
+	unsigned long long sumsq;
+	unsigned int min;
+	unsigned int max;
+	unsigned long long block_sum;
+	int block_n;
+	double *decimated;
+	int n_decimated;
+	int decimated_size;
+} SD_REDUCE_FIELD;
+
+// Reduces fixed length records as they arrive in arbitrary chunks
+typedef struct {
+	int record_length;
+	int decimate;
+	int n_fields;
+	SD_REDUCE_FIELD fields[SD_REDUCE_MAX_FIELDS];
+	unsigned char *partial;
+	int n_partial;
+	unsigned long long records;
+} SD_REDUCER_T;
+
+typedef SD_REDUCER_T* SD_REDUCER;
+
+/**
+ * Create a reducer for records of record_length bytes.
+ * @param decimate N for N:1 block averaged columns, 0 for none
+ * @returns NULL on error
+ */
+SD_REDUCER sd_reducer_new(int record_length, int decimate);
+
+/**
+ * Reduce the big-endian u16 at offset within every record.
+ * @returns the field index or SERIAL_DEVICE_ERR_NULL if it does not fit
+ */
+int sd_reducer_add_field(SD_REDUCER r, int offset);
+
+/**
+ * Consume n bytes.  Records may be split across calls.
+ * @returns SERIAL_DEVICE_OK or SERIAL_DEVICE_ERR_MEMORY if the
+ * decimated columns could not grow
+ */
+int sd_reducer_feed(SD_REDUCER r, const unsigned char *data, int n);
+
+/**
+ * Flush a trailing partial decimation block.
+ * @returns SERIAL_DEVICE_OK or SERIAL_DEVICE_ERR_MEMORY
+ */
+int sd_reducer_finish(SD_REDUCER r);
+
+/**
+ * Mean, min, max and RMS of a field over everything fed so far
+ */
+void sd_reducer_stats(SD_REDUCER r, int field, double *mean, unsigned int *min, unsigned int *max, double *rms);
+
+/**
+ * Forget everything fed so far, keeping the fields
+ */
+void sd_reducer_reset(SD_REDUCER r);
+
+void sd_reducer_free(SD_REDUCER r);
+
+/**
+ * Read exactly n_bytes from the device, reducing them as they arrive.
+ * @param raw if not NULL also receives the full resolution bytes
+ * @returns SERIAL_DEVICE_OK, SERIAL_DEVICE_ERR_STUCK if the device
+ * goes quiet before n_bytes arrive or SERIAL_DEVICE_ERR_MEMORY
+ */
+int sd_acquire_reduced(SERIAL_DEVICE sd, int n_bytes, SD_REDUCER r, char *raw);
+
+#endif
@@ -0,0 +1,423 @@
+/*
+ * Fan-out of a single serial device stream to several consumers.
+ * One reader thread owns the device and publishes into a ring buffer,
+ * each subscriber keeps its own cursor into the same bytes.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "serial_stream.h"
+
+/* How long the reader waits on a full ring before re-checking running */
+#define SD_STREAM_POLL_MS 100
+
+/**
+ * Fill in an absolute CLOCK_MONOTONIC deadline ms from now
+ */
+static void sd_stream_deadline(struct timespec *ts, int ms)
+{
+  clock_gettime(CLOCK_MONOTONIC, ts);
+  ts->tv_sec += ms / 1000;
+  ts->tv_nsec += (long)(ms % 1000) * 1000000L;
+  if (ts->tv_nsec >= 1000000000L) {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000L;
+  }
+}
+
+/**
+ * Bytes the reader may publish without overrunning a blocking
+ * subscriber.  Call with the lock held.
+ */
+static int sd_stream_room(SD_STREAM st)
+{
+  unsigned long long used = 0;
+  SD_SUBSCRIBER sub;
+
+  for (sub = st->subscribers; NULL != sub; sub = sub->next) {
+    if (NULL == sub->callback && SD_STREAM_POLICY_BLOCK == sub->policy
+	&& st->head - sub->cursor > used) {
+      used = st->head - sub->cursor;
+    }
+  }
+  return st->capacity - (int)used;
+}
+
+/**
+ * Hand freshly published bytes [from, head) to callback subscribers.
+ * Call with the lock held.
+ */
+static void sd_stream_dispatch(SD_STREAM st, unsigned long long from)
+{
+  SD_SUBSCRIBER sub;
+  int off = (int)(from % st->capacity);
+  int n = (int)(st->head - from);
+
+  for (sub = st->subscribers; NULL != sub; sub = sub->next) {
+    if (NULL != sub->callback) {
+      sub->callback(st->buf + off, n, sub->ctx);
+      sub->cursor = st->head;
+    }
+  }
+}
+
+/**
+ * Reader thread.  Reads straight into the ring so each byte is
+ * received once no matter how many subscribers there are.
+ */
+static void *sd_stream_run(void *arg)
+{
+  SD_STREAM st = (SD_STREAM)arg;
+  SD_SUBSCRIBER sub;
+  struct timespec ts;
+  unsigned long long floor;
+  int room, off, n, got;
+
+  pthread_mutex_lock(&st->lock);
+  while (st->running) {
+
+    room = sd_stream_room(st);
+    if (0 >= room) {
+      sd_stream_deadline(&ts, SD_STREAM_POLL_MS);
+      pthread_cond_timedwait(&st->space_ready, &st->lock, &ts);
+      continue;
+    }
+
+    /*
+      Read at most a quarter ring at a time, the reserved region is
+      lost to lagging :drop subscribers even if read() returns less
+    */
+    off = (int)(st->head % st->capacity);
+    n = st->capacity - off;
+    if (n > room) {
+      n = room;
+    }
+    if (n > st->capacity / 4 && 4 <= st->capacity) {
+      n = st->capacity / 4;
+    }
+
+    /* Push lagging non-blocking cursors past the region about to be overwritten */
+    if (st->head + n > (unsigned long long)st->capacity) {
+      floor = st->head + n - st->capacity;
+      for (sub = st->subscribers; NULL != sub; sub = sub->next) {
+	if (sub->cursor < floor) {
+	  sub->dropped += floor - sub->cursor;
+	  sub->cursor = floor;
+	}
+      }
+    }
+
+    pthread_mutex_unlock(&st->lock);
+    got = sd_read_nbytes(st->sd, n, st->buf + off);
+    if (0 > got && (EINTR == errno || EAGAIN == errno)) {
+      got = 0;
+    }
+    pthread_mutex_lock(&st->lock);
+
+    if (0 > got) {
+      /* A closed fd ends the stream rather than being polled again */
+      st->err = (EBADF == errno) ? SERIAL_DEVICE_ERR_CLOSED : SERIAL_DEVICE_ERR_READ;
+      break;
+    } else if (0 < got) {
+      st->head += got;
+      sd_stream_dispatch(st, st->head - got);
+      pthread_cond_broadcast(&st->data_ready);
+    }
+  }
+  st->running = 0;
+  pthread_cond_broadcast(&st->data_ready);
+  pthread_mutex_unlock(&st->lock);
+
+  sd_unclaim(st->sd, SD_CLAIM_READ);
+  return NULL;
+}
+
+/**
+ * Create a stream.  Holds a reference on sd until released.
+ */
+SD_STREAM sd_stream_new(SERIAL_DEVICE sd, int capacity)
+{
+  SD_STREAM st;
+  pthread_condattr_t attr;
+
+  if (NULL == sd) {
+    return NULL;
+  }
+  if (0 >= capacity) {
+    capacity = SD_STREAM_DEFAULT_CAPACITY;
+  }
+
+  st = (SD_STREAM)calloc(1, sizeof(SD_STREAM_T));
+  if (NULL == st) {
+    return NULL;
+  }
+  st->buf = (char *)malloc(capacity);
+  if (NULL == st->buf) {
+    free(st);
+    return NULL;
+  }
+
+  st->capacity = capacity;
+  st->refcount = 1;
+  st->err = SERIAL_DEVICE_OK;
+  st->sd = sd_retain(sd);
+
+  pthread_mutex_init(&st->lock, NULL);
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&st->data_ready, &attr);
+  pthread_cond_init(&st->space_ready, &attr);
+  pthread_condattr_destroy(&attr);
+
+  return st;
+}
+
+/**
+ * Spawn the reader thread.  The device cannot be closed, or read by
+ * another stream, until the thread exits.  A reader that ended on a
+ * device error is reaped so the stream can be started again.
+ */
+int sd_stream_start(SD_STREAM st)
+{
+  int err = SERIAL_DEVICE_OK;
+  int join = 0;
+  pthread_t finished;
+
+  if (NULL == st) {
+    return SERIAL_DEVICE_ERR_NULL;
+  }
+
+  pthread_mutex_lock(&st->lock);
+  if (st->started && !st->running) {
+    finished = st->thread;
+    st->started = 0;
+    join = 1;
+  }
+  pthread_mutex_unlock(&st->lock);
+
+  /* The reader drops its claim before exiting, so joining frees the device */
+  if (join) {
+    pthread_join(finished, NULL);
+  }
+
+  pthread_mutex_lock(&st->lock);
+  if (!st->started) {
+    err = sd_claim(st->sd, SD_CLAIM_READ);
+  }
+  if (!st->started && SERIAL_DEVICE_OK == err) {
+    st->running = 1;
+    st->err = SERIAL_DEVICE_OK;
+    if (0 != pthread_create(&st->thread, NULL, sd_stream_run, st)) {
+      st->running = 0;
+      sd_unclaim(st->sd, SD_CLAIM_READ);
+      err = SERIAL_DEVICE_ERR_THREAD;
+    } else {
+      st->started = 1;
+    }
+  }
+  pthread_mutex_unlock(&st->lock);
+
+  return err;
+}
+
+/**
+ * Ask the reader to finish and wait for it.  Subscribers can still
+ * drain what was already published.
+ */
+void sd_stream_stop(SD_STREAM st)
+{
+  int join;
+
+  if (NULL == st) {
+    return;
+  }
+
+  pthread_mutex_lock(&st->lock);
+  st->running = 0;
+  join = st->started;
+  st->started = 0;
+  pthread_cond_broadcast(&st->space_ready);
+  pthread_cond_broadcast(&st->data_ready);
+  pthread_mutex_unlock(&st->lock);
+
+  if (join) {
+    pthread_join(st->thread, NULL);
+  }
+}
+
+/**
+ * Wake blocked subscribers
+ */
+void sd_stream_wake(SD_STREAM st)
+{
+  if (NULL != st) {
+    pthread_mutex_lock(&st->lock);
+    pthread_cond_broadcast(&st->data_ready);
+    pthread_mutex_unlock(&st->lock);
+  }
+}
+
+/**
+ * Release a reference, tearing the stream down with the last one
+ */
+void sd_stream_release(SD_STREAM st)
+{
+  int refcount;
+
+  if (NULL == st) {
+    return;
+  }
+  pthread_mutex_lock(&st->lock);
+  refcount = --st->refcount;
+  pthread_mutex_unlock(&st->lock);
+  if (0 < refcount) {
+    return;
+  }
+
+  sd_stream_stop(st);
+  pthread_cond_destroy(&st->space_ready);
+  pthread_cond_destroy(&st->data_ready);
+  pthread_mutex_destroy(&st->lock);
+  sd_destroy(st->sd);
+  free(st->buf);
+  free(st);
+}
+
+/**
+ * Add a subscriber positioned at the current head
+ */
+SD_SUBSCRIBER sd_stream_subscribe(SD_STREAM st, int policy, sd_stream_callback callback, void *ctx)
+{
+  SD_SUBSCRIBER sub;
+
+  if (NULL == st) {
+    return NULL;
+  }
+  if (SD_STREAM_POLICY_DROP != policy && SD_STREAM_POLICY_BLOCK != policy
+      && SD_STREAM_POLICY_COALESCE != policy) {
+    return NULL;
+  }
+
+  sub = (SD_SUBSCRIBER)calloc(1, sizeof(SD_SUBSCRIBER_T));
+  if (NULL == sub) {
+    return NULL;
+  }
+  sub->stream = st;
+  sub->policy = policy;
+  sub->callback = callback;
+  sub->ctx = ctx;
+
+  pthread_mutex_lock(&st->lock);
+  sub->cursor = st->head;
+  sub->next = st->subscribers;
+  st->subscribers = sub;
+  st->refcount++;
+  pthread_mutex_unlock(&st->lock);
+
+  return sub;
+}
+
+/**
+ * Remove a subscriber and drop its reference on the stream
+ */
+void sd_stream_unsubscribe(SD_SUBSCRIBER sub)
+{
+  SD_STREAM st;
+  SD_SUBSCRIBER *p;
+
+  if (NULL == sub) {
+    return;
+  }
+  st = sub->stream;
+
+  pthread_mutex_lock(&st->lock);
+  for (p = &st->subscribers; NULL != *p; p = &(*p)->next) {
+    if (*p == sub) {
+      *p = sub->next;
+      break;
+    }
+  }
+  /* A blocking subscriber may have been what held the reader back */
+  pthread_cond_broadcast(&st->space_ready);
+  pthread_mutex_unlock(&st->lock);
+
+  free(sub);
+  sd_stream_release(st);
+}
+
+/**
+ * Copy unread bytes out of the ring for a pull subscriber
+ */
+int sd_subscriber_read(SD_SUBSCRIBER sub, char *buf, int n, int timeout_ms, volatile int *cancel)
+{
+  SD_STREAM st;
+  struct timespec ts;
+  unsigned long long avail;
+  int off, first, retval = 0;
+
+  if (NULL == sub || NULL == buf || 0 >= n) {
+    return SERIAL_DEVICE_ERR_NULL;
+  }
+  st = sub->stream;
+
+  if (0 <= timeout_ms) {
+    sd_stream_deadline(&ts, timeout_ms);
+  }
+
+  pthread_mutex_lock(&st->lock);
+  while (st->running && st->head == sub->cursor && !(cancel && *cancel)) {
+    if (0 > timeout_ms) {
+      pthread_cond_wait(&st->data_ready, &st->lock);
+    } else if (ETIMEDOUT == pthread_cond_timedwait(&st->data_ready, &st->lock, &ts)) {
+      break;
+    }
+  }
+
+  avail = st->head - sub->cursor;
+  if (0 == avail) {
+    retval = (st->running || (cancel && *cancel)) ? 0 : SERIAL_DEVICE_ERR_STOPPED;
+  } else {
+    if (SD_STREAM_POLICY_COALESCE == sub->policy && avail > (unsigned long long)n) {
+      sub->dropped += avail - n;
+      sub->cursor = st->head - n;
+      avail = n;
+    }
+    retval = avail < (unsigned long long)n ? (int)avail : n;
+
+    off = (int)(sub->cursor % st->capacity);
+    first = st->capacity - off;
+    if (first >= retval) {
+      memcpy(buf, st->buf + off, retval);
+    } else {
+      memcpy(buf, st->buf + off, first);
+      memcpy(buf + first, st->buf, retval - first);
+    }
+    sub->cursor += retval;
+
+    if (SD_STREAM_POLICY_BLOCK == sub->policy) {
+      pthread_cond_broadcast(&st->space_ready);
+    }
+  }
+  pthread_mutex_unlock(&st->lock);
+
+  return retval;
+}
+
+/**
+ * Unread byte count for a subscriber
+ */
+int sd_subscriber_pending(SD_SUBSCRIBER sub)
+{
+  int n;
+
+  if (NULL == sub) {
+    return 0;
+  }
+  pthread_mutex_lock(&sub->stream->lock);
+  n = (int)(sub->stream->head - sub->cursor);
+  pthread_mutex_unlock(&sub->stream->lock);
+
+  return n;
+}
@@ -0,0 +1,110 @@
+#ifndef SERIAL_STREAM_H
+#define SERIAL_STREAM_H
+
+#include <pthread.h>
+#include "serial_device.h"
+
+#define SD_STREAM_DEFAULT_CAPACITY 65536
+
+/** What to do when a subscriber falls more than a buffer behind */
+#define SD_STREAM_POLICY_DROP 0      /* lose the oldest bytes, count them */
+#define SD_STREAM_POLICY_BLOCK 1     /* stall the reader until it catches up */
+#define SD_STREAM_POLICY_COALESCE 2  /* skip to the newest bytes on each read */
+
+/**
+ * Called on the reader thread with bytes still in the shared ring,
+ * one call per contiguous read().  Do not block.
+ */
+typedef void (*sd_stream_callback)(const char *data, int n, void *ctx);
+
+struct SD_STREAM_T;
+
+// One consumer of the stream with its own cursor
+typedef struct SD_SUBSCRIBER_T {
+	struct SD_STREAM_T *stream;
+	unsigned long long cursor;
+	unsigned long long dropped;
+	int policy;
+	sd_stream_callback callback;
+	void *ctx;
+	struct SD_SUBSCRIBER_T *next;
+} SD_SUBSCRIBER_T;
+
+typedef SD_SUBSCRIBER_T* SD_SUBSCRIBER;
+
+// Single reader thread publishing a device into a shared ring buffer
+typedef struct SD_STREAM_T {
+	SERIAL_DEVICE sd;
+	char *buf;
+	int capacity;
+	unsigned long long head;
+	int running;
+	int started;
+	int err;
+	int refcount;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t data_ready;
+	pthread_cond_t space_ready;
+	SD_SUBSCRIBER subscribers;
+} SD_STREAM_T;
+
+typedef SD_STREAM_T* SD_STREAM;
+
+/**
+ * Create a stream over the device with a ring of capacity bytes.
+ * The stream holds a reference on sd.  Returns NULL on error.
+ */
+SD_STREAM sd_stream_new(SERIAL_DEVICE sd, int capacity);
+
+/**
+ * Start the reader thread, claiming the device for reading.
+ * Also restarts a stream whose reader stopped on a device error.
+ * @returns SERIAL_DEVICE_OK, SERIAL_DEVICE_ERR_THREAD, or
+ * SERIAL_DEVICE_ERR_BUSY / SERIAL_DEVICE_ERR_CLOSED from sd_claim
+ */
+int sd_stream_start(SD_STREAM st);
+
+/**
+ * Stop the reader thread and wake every waiting subscriber.
+ */
+void sd_stream_stop(SD_STREAM st);
+
+/**
+ * Wake every subscriber blocked in sd_subscriber_read so it can
+ * re-check its cancel flag.
+ */
+void sd_stream_wake(SD_STREAM st);
+
+/**
+ * Drop a reference on the stream, freeing it with the last one.
+ * Subscribers each hold a reference.
+ */
+void sd_stream_release(SD_STREAM st);
+
+/**
+ * Attach a consumer starting at the current head.  A non-NULL
+ * callback is invoked from the reader thread and ignores policy.
+ */
+SD_SUBSCRIBER sd_stream_subscribe(SD_STREAM st, int policy, sd_stream_callback callback, void *ctx);
+
+/**
+ * Detach and free a subscriber.
+ */
+void sd_stream_unsubscribe(SD_SUBSCRIBER sub);
+
+/**
+ * Copy up to n bytes past the subscriber's cursor into buf, waiting
+ * up to timeout_ms (negative waits forever) for data to arrive.
+ * *cancel may be set from another thread to abandon the wait.
+ * @returns the number of bytes copied, 0 on timeout or
+ * SERIAL_DEVICE_ERR_STOPPED once the stream has ended and is drained.
+ */
+int sd_subscriber_read(SD_SUBSCRIBER sub, char *buf, int n, int timeout_ms, volatile int *cancel);
+
+/**
+ * Number of bytes the subscriber has not consumed yet
+ */
+int sd_subscriber_pending(SD_SUBSCRIBER sub);
+
+#endif
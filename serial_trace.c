@@ -0,0 +1,297 @@
+/*
+ * Transaction timeline of every serial device in the process,
+ * kept in a ring and exported as Chrome trace JSON for viewing in
+ * chrome://tracing or Perfetto.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include "serial_trace.h"
+
+// A lane in the trace, one per device path
+typedef struct {
+	char *device;
+	char last_command[SD_TRACE_COMMAND_SIZE];
+} SD_TRACE_DEVICE_T;
+
+volatile int sd_trace_enabled = 0;
+
+static pthread_mutex_t sd_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static SD_TRACE_EVENT *sd_trace_ring = NULL;
+static int sd_trace_capacity = 0;
+static unsigned long long sd_trace_count = 0;
+static SD_TRACE_DEVICE_T sd_trace_devices[SD_TRACE_MAX_DEVICES];
+static int sd_trace_n_devices = 0;
+
+#define SD_TRACE_TYPES 6
+
+static const char *sd_trace_names[SD_TRACE_TYPES] = {
+  "write", "read", "read_bytes", "first_byte", "timeout", "error"
+};
+
+/**
+ * Monotonic clock in nanoseconds
+ */
+unsigned long long sd_trace_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Lane for a device path, added on first use.  Call with the lock held.
+ * Devices past SD_TRACE_MAX_DEVICES share the last lane.
+ */
+static int sd_trace_device(const char *device)
+{
+  int i;
+
+  if (NULL == device) {
+    device = "unknown";
+  }
+  for (i = 0; i < sd_trace_n_devices; i++) {
+    if (0 == strcmp(sd_trace_devices[i].device, device)) {
+      return i;
+    }
+  }
+  if (SD_TRACE_MAX_DEVICES == sd_trace_n_devices) {
+    return SD_TRACE_MAX_DEVICES - 1;
+  }
+  sd_trace_devices[i].device = strdup(device);
+  sd_trace_devices[i].last_command[0] = '\0';
+  return sd_trace_n_devices++;
+}
+
+/**
+ * Append an event, overwriting the oldest once the ring is full
+ */
+void sd_trace_record(SERIAL_DEVICE sd, int type, char phase, const char *command, int value, unsigned long long start_ns)
+{
+  SD_TRACE_EVENT *ev;
+  unsigned long long now = sd_trace_now();
+  int errsv = errno;
+  int device;
+
+  pthread_mutex_lock(&sd_trace_lock);
+  if (!sd_trace_enabled || NULL == sd_trace_ring) {
+    pthread_mutex_unlock(&sd_trace_lock);
+    errno = errsv;
+    return;
+  }
+
+  device = sd_trace_device(NULL == sd ? NULL : sd->device);
+  if (NULL != command) {
+    strncpy(sd_trace_devices[device].last_command, command, SD_TRACE_COMMAND_SIZE - 1);
+    sd_trace_devices[device].last_command[SD_TRACE_COMMAND_SIZE - 1] = '\0';
+  }
+
+  ev = &sd_trace_ring[sd_trace_count++ % sd_trace_capacity];
+  ev->ts_ns = SD_TRACE_COMPLETE == phase ? start_ns : now;
+  ev->dur_ns = SD_TRACE_COMPLETE == phase ? now - start_ns : 0;
+  ev->value = value;
+  ev->device = (short)device;
+  ev->type = (char)type;
+  ev->phase = phase;
+  memcpy(ev->command, sd_trace_devices[device].last_command, SD_TRACE_COMMAND_SIZE);
+
+  pthread_mutex_unlock(&sd_trace_lock);
+  /* Callers look at errno after a failed read */
+  errno = errsv;
+}
+
+/**
+ * Allocate a fresh ring and start recording
+ */
+int sd_trace_enable(int capacity)
+{
+  SD_TRACE_EVENT *ring;
+
+  if (0 >= capacity) {
+    capacity = SD_TRACE_DEFAULT_CAPACITY;
+  }
+  ring = (SD_TRACE_EVENT *)malloc(capacity * sizeof(SD_TRACE_EVENT));
+  if (NULL == ring) {
+    return SERIAL_DEVICE_ERR_NULL;
+  }
+
+  pthread_mutex_lock(&sd_trace_lock);
+  free(sd_trace_ring);
+  sd_trace_ring = ring;
+  sd_trace_capacity = capacity;
+  sd_trace_count = 0;
+  sd_trace_enabled = 1;
+  pthread_mutex_unlock(&sd_trace_lock);
+
+  return SERIAL_DEVICE_OK;
+}
+
+/**
+ * Stop recording
+ */
+void sd_trace_disable(void)
+{
+  pthread_mutex_lock(&sd_trace_lock);
+  sd_trace_enabled = 0;
+  pthread_mutex_unlock(&sd_trace_lock);
+}
+
+/**
+ * Write s as the body of a JSON string
+ */
+static void sd_trace_json_string(FILE *f, const char *s)
+{
+  for (; '\0' != *s; s++) {
+    if ('"' == *s || '\\' == *s) {
+      fprintf(f, "\\%c", *s);
+    } else if ((unsigned char)*s < 0x20) {
+      fprintf(f, "\\u%04x", (unsigned char)*s);
+    } else {
+      fputc(*s, f);
+    }
+  }
+}
+
+/**
+ * Copy the ring, oldest event first, and the lane names so they can be
+ * written out without holding up the devices.  Lane names are never
+ * freed, so the pointers stay good.
+ * @returns the copy, to free, or NULL if it cannot be allocated
+ */
+static SD_TRACE_EVENT *sd_trace_snapshot(int *n_events, const char **devices, int *n_devices)
+{
+  SD_TRACE_EVENT *events;
+  unsigned long long first, i;
+  int n;
+
+  pthread_mutex_lock(&sd_trace_lock);
+  first = sd_trace_count > (unsigned long long)sd_trace_capacity ? sd_trace_count - sd_trace_capacity : 0;
+  n = (int)(sd_trace_count - first);
+  events = (SD_TRACE_EVENT *)malloc((0 < n ? n : 1) * sizeof(SD_TRACE_EVENT));
+  if (NULL != events) {
+    for (i = first; i < sd_trace_count; i++) {
+      events[i - first] = sd_trace_ring[i % sd_trace_capacity];
+    }
+    for (i = 0; i < (unsigned long long)sd_trace_n_devices; i++) {
+      devices[i] = sd_trace_devices[i].device;
+    }
+    *n_devices = sd_trace_n_devices;
+    *n_events = n;
+  }
+  pthread_mutex_unlock(&sd_trace_lock);
+
+  return events;
+}
+
+/**
+ * Clear keep for begin and end events that lost their other half,
+ * either overwritten when the ring wrapped or not yet recorded.
+ * Chrome would otherwise close the wrong span or leave one open.
+ */
+static void sd_trace_pair(const SD_TRACE_EVENT *events, int n, char *keep)
+{
+  int open[SD_TRACE_MAX_DEVICES][SD_TRACE_TYPES];
+  int i;
+
+  /* An end needs an earlier begin */
+  memset(open, 0, sizeof(open));
+  for (i = 0; i < n; i++) {
+    keep[i] = 1;
+    if (SD_TRACE_BEGIN == events[i].phase) {
+      open[(int)events[i].device][(int)events[i].type]++;
+    } else if (SD_TRACE_END == events[i].phase) {
+      if (0 < open[(int)events[i].device][(int)events[i].type]) {
+	open[(int)events[i].device][(int)events[i].type]--;
+      } else {
+	keep[i] = 0;
+      }
+    }
+  }
+
+  /* and a begin a later end that was kept */
+  memset(open, 0, sizeof(open));
+  for (i = n - 1; i >= 0; i--) {
+    if (SD_TRACE_END == events[i].phase && keep[i]) {
+      open[(int)events[i].device][(int)events[i].type]++;
+    } else if (SD_TRACE_BEGIN == events[i].phase) {
+      if (0 < open[(int)events[i].device][(int)events[i].type]) {
+	open[(int)events[i].device][(int)events[i].type]--;
+      } else {
+	keep[i] = 0;
+      }
+    }
+  }
+}
+
+/**
+ * Dump a copy of the ring, oldest event first
+ */
+int sd_trace_dump(const char *path)
+{
+  FILE *f;
+  SD_TRACE_EVENT *events, *ev;
+  const char *devices[SD_TRACE_MAX_DEVICES];
+  char *keep;
+  int n_events = 0, n_devices = 0, i, n = 0;
+
+  f = fopen(path, "w");
+  if (NULL == f) {
+    return -1;
+  }
+
+  events = sd_trace_snapshot(&n_events, devices, &n_devices);
+  keep = (char *)malloc(0 < n_events ? n_events : 1);
+  if (NULL == events || NULL == keep) {
+    free(events);
+    free(keep);
+    fclose(f);
+    return -1;
+  }
+  sd_trace_pair(events, n_events, keep);
+
+  fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+  /* Name each lane after its device */
+  fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"RbSerialDevice\"}}");
+  for (i = 0; i < n_devices; i++) {
+    fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"", i);
+    sd_trace_json_string(f, devices[i]);
+    fprintf(f, "\"}}");
+  }
+
+  for (i = 0; i < n_events; i++) {
+    if (!keep[i]) {
+      continue;
+    }
+    ev = &events[i];
+    fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"serial\",\"ph\":\"%c\",\"pid\":1,\"tid\":%d,\"ts\":%.3f",
+	    sd_trace_names[(int)ev->type], ev->phase, ev->device, ev->ts_ns / 1000.0);
+    if (SD_TRACE_COMPLETE == ev->phase) {
+      fprintf(f, ",\"dur\":%.3f", ev->dur_ns / 1000.0);
+    } else if (SD_TRACE_INSTANT == ev->phase) {
+      fprintf(f, ",\"s\":\"t\"");
+    }
+    fprintf(f, ",\"args\":{\"command\":\"");
+    sd_trace_json_string(f, ev->command);
+    if (SD_TRACE_ERROR == ev->type) {
+      fprintf(f, "\",\"error\":\"");
+      sd_trace_json_string(f, sd_errstring(ev->value));
+      fprintf(f, "\"}}");
+    } else {
+      fprintf(f, "\",\"value\":%d}}", ev->value);
+    }
+    n++;
+  }
+
+  fprintf(f, "\n]}\n");
+  free(events);
+  free(keep);
+
+  if (0 != fclose(f)) {
+    return -1;
+  }
+  return n;
+}
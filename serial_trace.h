@@ -0,0 +1,72 @@
+#ifndef SERIAL_TRACE_H
+#define SERIAL_TRACE_H
+
+#include "serial_device.h"
+
+#define SD_TRACE_DEFAULT_CAPACITY 65536
+#define SD_TRACE_MAX_DEVICES 64
+#define SD_TRACE_COMMAND_SIZE 24
+
+/** What an event records */
+#define SD_TRACE_WRITE 0       /* sd_write, begin/end */
+#define SD_TRACE_READ 1        /* sd_read, begin/end */
+#define SD_TRACE_READ_BYTES 2  /* sd_read_nbytes that returned data, complete */
+#define SD_TRACE_FIRST_BYTE 3  /* first byte of a response, instant */
+#define SD_TRACE_TIMEOUT 4     /* no response at all, instant */
+#define SD_TRACE_ERROR 5       /* value holds the error, instant */
+
+/** Chrome trace phases */
+#define SD_TRACE_BEGIN 'B'
+#define SD_TRACE_END 'E'
+#define SD_TRACE_COMPLETE 'X'
+#define SD_TRACE_INSTANT 'i'
+
+// One entry in the trace ring
+typedef struct {
+	unsigned long long ts_ns;
+	unsigned long long dur_ns;
+	int value;
+	short device;
+	char type;
+	char phase;
+	char command[SD_TRACE_COMMAND_SIZE];
+} SD_TRACE_EVENT;
+
+/** Non-zero while tracing, checked before any other work */
+extern volatile int sd_trace_enabled;
+
+/**
+ * Record an event against sd.  Use the SD_TRACE macro so nothing
+ * happens when tracing is off.
+ * @param command the command for a write, NULL to tag with the last one written
+ * @param start_ns when a SD_TRACE_COMPLETE event began
+ */
+void sd_trace_record(SERIAL_DEVICE sd, int type, char phase, const char *command, int value, unsigned long long start_ns);
+
+#define SD_TRACE(sd, type, phase, command, value) \
+  do { if (sd_trace_enabled) sd_trace_record(sd, type, phase, command, value, 0); } while (0)
+
+/** CLOCK_MONOTONIC in nanoseconds */
+unsigned long long sd_trace_now(void);
+
+/**
+ * Start tracing into a ring of capacity events, discarding any
+ * previous trace.
+ * @returns SERIAL_DEVICE_OK or SERIAL_DEVICE_ERR_NULL if it cannot be allocated
+ */
+int sd_trace_enable(int capacity);
+
+/**
+ * Stop recording.  The ring is kept for sd_trace_dump.
+ */
+void sd_trace_disable(void);
+
+/**
+ * Write the ring as Chrome trace JSON, one lane per device.  The ring
+ * is copied first, so recording carries on while the file is written.
+ * Begin and end events whose other half is not in the ring are left out.
+ * @returns the number of events written or -1 if path cannot be written
+ */
+int sd_trace_dump(const char *path);
+
+#endif
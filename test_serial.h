@@ -0,0 +1,68 @@
+/*
+ * Shared pieces of the C tests, which run against pseudo terminals so
+ * no hardware is needed.  Each test is a single file including this.
+ */
+#ifndef TEST_SERIAL_H
+#define TEST_SERIAL_H
+
+#define _XOPEN_SOURCE 600
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "serial_device.h"
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); failures++; } \
+  } while (0)
+
+#define CHECK_NEAR(a, b, tolerance) CHECK(fabs((a) - (b)) < (tolerance))
+
+/**
+ * Open a pseudo terminal master, -1 if there are none
+ */
+static int test_open_master(void)
+{
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (0 > master || 0 > grantpt(master) || 0 > unlockpt(master)) {
+    return -1;
+  }
+  return master;
+}
+
+/**
+ * A SERIAL_DEVICE on the slave side of a fresh pseudo terminal.
+ * The far end is returned in *master.
+ * @returns NULL, having reported why, if there is none
+ */
+static SERIAL_DEVICE test_open_device(int *master)
+{
+  SERIAL_DEVICE sd;
+
+  *master = test_open_master();
+  if (0 > *master) {
+    printf("No pseudo terminal available\n");
+    return NULL;
+  }
+  sd = sd_init(ptsname(*master));
+  if (NULL == sd) {
+    printf("Could not open %s\n", ptsname(*master));
+    close(*master);
+  }
+  return sd;
+}
+
+/**
+ * Report the outcome, for main to return
+ */
+static int test_result(void)
+{
+  printf("%s\n", 0 == failures ? "OK" : "FAILED");
+  return 0 == failures ? 0 : 1;
+}
+
+#endif
@@ -0,0 +1,230 @@
+/*
+ * Runs serial_control.c against a simulated plant on two pseudo
+ * terminals: a sensor answering READ and an actuator taking SET.
+ * Build and run with `make test` after `ruby extconf.rb`.
+ */
+#include "test_serial.h"
+#include <signal.h>
+#include <sys/select.h>
+#include "serial_control.h"
+
+/* The plant reads 100 + GAIN * the last SET */
+#define BASE 100.0
+#define GAIN 10.0
+
+#define LINE_SIZE 64
+
+typedef struct {
+  int sensor;     /* pty masters */
+  int actuator;
+  double u;
+  int sets;
+  volatile int stop;
+  pthread_mutex_t lock;
+} PLANT_T;
+
+/**
+ * Append what is waiting on fd to line, true once it holds a whole command
+ */
+static int plant_line(int fd, char *line, int *n)
+{
+  char c;
+
+  while (1 == read(fd, &c, 1)) {
+    if ('\r' == c) {
+      line[*n] = '\0';
+      *n = 0;
+      return 1;
+    }
+    if (*n < LINE_SIZE - 1) {
+      line[(*n)++] = c;
+    }
+  }
+  return 0;
+}
+
+static void *plant_run(void *arg)
+{
+  PLANT_T *p = (PLANT_T *)arg;
+  char sensor_line[LINE_SIZE], actuator_line[LINE_SIZE], reply[LINE_SIZE];
+  int sensor_n = 0, actuator_n = 0;
+  struct timeval timeout;
+  fd_set fds;
+  double u;
+
+  while (!p->stop) {
+    FD_ZERO(&fds);
+    FD_SET(p->sensor, &fds);
+    FD_SET(p->actuator, &fds);
+    timeout.tv_sec = 0;
+    timeout.tv_usec = 10000;
+    if (0 >= select((p->sensor > p->actuator ? p->sensor : p->actuator) + 1, &fds, NULL, NULL, &timeout)) {
+      continue;
+    }
+
+    if (FD_ISSET(p->sensor, &fds) && plant_line(p->sensor, sensor_line, &sensor_n)
+	&& 0 == strcmp("READ", sensor_line)) {
+      pthread_mutex_lock(&p->lock);
+      snprintf(reply, LINE_SIZE, "%.4f\r\n", BASE + GAIN * p->u);
+      pthread_mutex_unlock(&p->lock);
+      write(p->sensor, reply, strlen(reply));
+    }
+
+    if (FD_ISSET(p->actuator, &fds) && plant_line(p->actuator, actuator_line, &actuator_n)
+	&& 1 == sscanf(actuator_line, "SET %lf", &u)) {
+      pthread_mutex_lock(&p->lock);
+      p->u = u;
+      p->sets++;
+      pthread_mutex_unlock(&p->lock);
+      write(p->actuator, "OK\r\n", 4);
+    }
+  }
+  return NULL;
+}
+
+static void ignore_signal(int sig)
+{
+}
+
+/**
+ * Wait up to ms for the loop to hold its input within 0.5 of target,
+ * pestering the loop thread with signals if interrupt is set
+ */
+static int converge(SD_CONTROL c, double target, int ms, int interrupt)
+{
+  SD_CONTROL_STATE state;
+  int waited;
+
+  for (waited = 0; waited < ms; waited++) {
+    if (interrupt) {
+      pthread_kill(c->thread, SIGUSR1);
+    }
+    usleep(1000);
+    sd_control_state(c, &state);
+    if (!state.running) {
+      return 0;
+    }
+    if (0 == waited % 50 && 0 < state.iterations && 0.5 > fabs(state.input - target)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+
+  SERIAL_DEVICE in, out;
+  SD_CONTROL c, other;
+  SD_CONTROL_CONFIG config;
+  SD_CONTROL_STATE state;
+  PLANT_T plant;
+  pthread_t plant_thread;
+  struct sigaction sa;
+  double integral;
+  int dir, tries;
+
+  in = test_open_device(&plant.sensor);
+  out = test_open_device(&plant.actuator);
+  CHECK(NULL != in && NULL != out);
+  if (NULL == in || NULL == out) {
+    return 1;
+  }
+  fcntl(plant.sensor, F_SETFL, O_NONBLOCK);
+  fcntl(plant.actuator, F_SETFL, O_NONBLOCK);
+  plant.u = 0;
+  plant.sets = 0;
+  plant.stop = 0;
+  pthread_mutex_init(&plant.lock, NULL);
+  pthread_create(&plant_thread, NULL, plant_run, &plant);
+
+  /* Signals without SA_RESTART, so the loop sees EINTR */
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = ignore_signal;
+  sigaction(SIGUSR1, &sa, NULL);
+
+  memset(&config, 0, sizeof(config));
+  strcpy(config.input.command, "READ");
+  config.input.first_ms = 50;
+  config.input.idle_ms = 5;
+  strcpy(config.output, "SET %.4f");
+  config.ack_ms = 20;
+  config.ki = 1.0;
+  config.setpoint = 150;
+  config.out_min = -10;
+  config.out_max = 10;
+  config.rate = 50;
+
+  /* Settings that would never run are refused */
+  config.rate = NAN;
+  CHECK(NULL == sd_control_new(in, out, &config));
+  config.rate = 50;
+  config.out_min = NAN;
+  CHECK(NULL == sd_control_new(in, out, &config));
+  config.out_min = -10;
+
+  c = sd_control_new(in, out, &config);
+  CHECK(NULL != c);
+  if (NULL == c) {
+    return 1;
+  }
+  CHECK(SERIAL_DEVICE_OK == sd_control_start(c));
+
+  /* While it runs the loop owns both devices */
+  other = sd_control_new(in, out, &config);
+  CHECK(SERIAL_DEVICE_ERR_BUSY == sd_control_start(other));
+  sd_control_destroy(other);
+  CHECK(SERIAL_DEVICE_ERR_BUSY == sd_close(in));
+  CHECK(SERIAL_DEVICE_ERR_BUSY == sd_claim(out, SD_CLAIM_WRITE));
+  CHECK(0 <= in->fd);
+
+  /* Settles at 150, even with signals landing in its select and write */
+  CHECK(converge(c, 150, 3000, 1));
+  sd_control_state(c, &state);
+  CHECK(state.running && SERIAL_DEVICE_OK == state.err);
+  CHECK(0 < state.interval_ns);
+  CHECK(0.1 > fabs(state.output - 5.0));
+  CHECK(SERIAL_DEVICE_ERR_NULL == sd_control_set_gains(c, 0, NAN, 0));
+
+  /* Out of reach: the output pins at its limit and the integral stops growing */
+  CHECK(SERIAL_DEVICE_OK == sd_control_set_setpoint(c, 250));
+  usleep(500000);
+  sd_control_state(c, &state);
+  CHECK(10.0 == state.output);
+  integral = state.integral;
+  usleep(300000);
+  sd_control_state(c, &state);
+  CHECK(10.0 == state.output);
+  CHECK(integral == state.integral);
+
+  /* Without wind up to unwind it comes straight back */
+  CHECK(SERIAL_DEVICE_OK == sd_control_set_setpoint(c, 150));
+  CHECK(converge(c, 150, 1500, 0));
+
+  /* A device error stops the loop and gives both devices back */
+  dir = open("/", O_RDONLY);
+  dup2(dir, in->fd);
+  close(dir);
+  for (tries = 0; tries < 200; tries++) {
+    sd_control_state(c, &state);
+    if (!state.running) {
+      break;
+    }
+    usleep(10000);
+  }
+  CHECK(!state.running);
+  CHECK(SERIAL_DEVICE_OK != state.err);
+  CHECK(0 == in->claimed && 0 == out->claimed);
+  CHECK(SERIAL_DEVICE_OK == sd_claim(out, SD_CLAIM_WRITE));
+  sd_unclaim(out, SD_CLAIM_WRITE);
+
+  sd_control_destroy(c);
+  plant.stop = 1;
+  pthread_join(plant_thread, NULL);
+  CHECK(SERIAL_DEVICE_OK == sd_close(in));
+  sd_destroy(in);
+  sd_destroy(out);
+  close(plant.sensor);
+  close(plant.actuator);
+
+  return test_result();
+}
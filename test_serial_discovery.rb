@@ -0,0 +1,82 @@
+#
+# test_serial_discovery.rb
+#
+# Discovers a simulated board on a pseudo terminal, then checks the
+# cache is trusted and that probing can be interrupted.
+# Run with `make test` after `ruby extconf.rb`.
+#
+require 'pty'
+require 'io/console'
+require 'serial_device_discovery'
+
+$failures = 0
+
+def check(cond, what)
+  unless cond
+    puts "FAIL #{what}"
+    $failures += 1
+  end
+end
+
+def elapsed
+  start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+  yield
+  Process.clock_gettime(Process::CLOCK_MONOTONIC) - start
+end
+
+# A board that only answers IDN, with a CR LF like the real ones
+board, board_slave = PTY.open
+board.raw!
+responder = fork do
+  line = ""
+  while c = board.getc
+    if "\r" == c
+      board.write("BOARD-A\r\n") if "IDN" == line
+      line = ""
+    else
+      line << c
+    end
+  end
+  exit!
+end
+
+# and a port with nothing on it
+silent, silent_slave = PTY.open
+silent.raw!
+
+cache = "/tmp/test_serial_discovery.#{Process.pid}.yml"
+ports = [board_slave.path, silent_slave.path]
+expected = {"BOARD-A" => [{:device => board_slave.path, :baud => 57600, :probe => "IDN"}]}
+
+found = SerialDevice.discover(:ports => ports, :timeout => 0.2, :cache => cache)
+check(expected == found, "discovered #{found.inspect}")
+
+# With the board gone the cache is still believed, without probing
+Process.kill("TERM", responder)
+Process.wait(responder)
+found = nil
+took = elapsed { found = SerialDevice.discover(:ports => ports, :timeout => 0.2, :cache => cache) }
+check(expected == found, "cached #{found.inspect}")
+check(0.1 > took, "cache took #{took}s")
+
+# unless a port in it has gone, or :refresh asks for a scan
+found = SerialDevice.discover(:ports => ports, :timeout => 0.2, :cache => cache, :refresh => true)
+check({} == found, "refreshed #{found.inspect}")
+File.open(cache, 'w') {|f| f.write(expected.merge("OTHER" => [{:device => "/dev/no_such_port"}]).to_yaml) }
+found = SerialDevice.discover(:ports => ports, :timeout => 0.2, :cache => cache)
+check({} == found, "stale cache #{found.inspect}")
+File.open(cache, 'w') {|f| f.write("--- !ruby/object:Object {}\n") }
+check(nil == SerialDevice.load_discovery_cache(cache), "unsafe cache is ignored")
+File.delete(cache)
+
+# A long probe gives up as soon as its thread is interrupted
+prober = Thread.new { SerialDevice.probe([silent_slave.path], [{:baud => 57600, :probe => "IDN"}], 10) }
+sleep 0.2
+took = elapsed { prober.kill; prober.join(2) }
+check(!prober.alive?, "probe still running")
+check(0.5 > took, "interrupt took #{took}s")
+
+[board, board_slave, silent, silent_slave].each {|io| io.close }
+
+puts(0 == $failures ? "OK" : "FAILED")
+exit(0 == $failures ? 0 : 1)
@@ -0,0 +1,118 @@
+/*
+ * Exercises serial_reduce.c on hand built records and through a
+ * pseudo terminal, no hardware needed.
+ * Build and run with `make test` after `ruby extconf.rb`.
+ */
+#include "test_serial.h"
+#include <limits.h>
+#include "serial_reduce.h"
+
+#define RECORD_LENGTH 7
+#define RECORDS 10
+#define OFFSET 3
+#define DECIMATE 4
+
+/**
+ * Records of filler bytes with 1000 + i as a big-endian u16 at OFFSET
+ */
+static void make_records(unsigned char *data)
+{
+  int i;
+
+  memset(data, 0xAA, RECORDS * RECORD_LENGTH);
+  for (i = 0; i < RECORDS; i++) {
+    data[i * RECORD_LENGTH + OFFSET] = (1000 + i) >> 8;
+    data[i * RECORD_LENGTH + OFFSET + 1] = (1000 + i) & 0xFF;
+  }
+}
+
+/**
+ * Check a reducer that has seen the records from make_records
+ */
+static void check_reduced(SD_REDUCER r, int field)
+{
+  double mean, rms, sumsq = 0.0;
+  unsigned int min, max;
+  int i;
+
+  for (i = 0; i < RECORDS; i++) {
+    sumsq += (1000.0 + i) * (1000.0 + i);
+  }
+
+  CHECK(RECORDS == r->records);
+  sd_reducer_stats(r, field, &mean, &min, &max, &rms);
+  CHECK_NEAR(1004.5, mean, 1e-9);
+  CHECK(1000 == min);
+  CHECK(1009 == max);
+  CHECK_NEAR(sqrt(sumsq / RECORDS), rms, 1e-9);
+
+  /* Two full 4:1 blocks, then the last two records on their own */
+  CHECK(3 == r->fields[field].n_decimated);
+  if (3 == r->fields[field].n_decimated) {
+    CHECK_NEAR(1001.5, r->fields[field].decimated[0], 1e-9);
+    CHECK_NEAR(1005.5, r->fields[field].decimated[1], 1e-9);
+    CHECK_NEAR(1008.5, r->fields[field].decimated[2], 1e-9);
+  }
+}
+
+int main(int argc, char **argv) {
+
+  SD_REDUCER r;
+  SERIAL_DEVICE sd;
+  unsigned char data[RECORDS * RECORD_LENGTH];
+  char raw[RECORDS * RECORD_LENGTH];
+  double mean, rms;
+  unsigned int min, max;
+  int field, master;
+
+  make_records(data);
+
+  r = sd_reducer_new(RECORD_LENGTH, DECIMATE);
+  CHECK(NULL != r);
+  if (NULL == r) {
+    return 1;
+  }
+  CHECK(SERIAL_DEVICE_ERR_NULL == sd_reducer_add_field(r, RECORD_LENGTH - 1));
+  field = sd_reducer_add_field(r, OFFSET);
+  CHECK(0 == field);
+
+  /* The first record is split across feeds */
+  CHECK(SERIAL_DEVICE_OK == sd_reducer_feed(r, data, 5));
+  CHECK(0 == r->records);
+  CHECK(SERIAL_DEVICE_OK == sd_reducer_feed(r, data + 5, sizeof(data) - 5));
+  CHECK(SERIAL_DEVICE_OK == sd_reducer_finish(r));
+  check_reduced(r, field);
+
+  /* Reset keeps the fields but forgets the data */
+  sd_reducer_reset(r);
+  CHECK(0 == r->records);
+  CHECK(0 == r->fields[field].n_decimated);
+  sd_reducer_stats(r, field, &mean, &min, &max, &rms);
+  CHECK(0.0 == mean && 0 == min && 0 == max);
+
+  /* The same records arriving over a pseudo terminal */
+  sd = test_open_device(&master);
+  CHECK(NULL != sd);
+  if (NULL == sd) {
+    return 1;
+  }
+  CHECK(sizeof(data) == write(master, data, sizeof(data)));
+  CHECK(SERIAL_DEVICE_OK == sd_acquire_reduced(sd, sizeof(data), r, raw));
+  check_reduced(r, field);
+  CHECK(0 == memcmp(data, raw, sizeof(data)));
+
+  /* A decimated column that cannot grow fails the feed rather than losing points */
+  sd_reducer_reset(r);
+  r->fields[field].n_decimated = r->fields[field].decimated_size = INT_MAX / 2 + 1;
+  CHECK(SERIAL_DEVICE_ERR_MEMORY == sd_reducer_feed(r, data, sizeof(data)));
+  CHECK(sizeof(data) == write(master, data, sizeof(data)));
+  CHECK(SERIAL_DEVICE_ERR_MEMORY == sd_acquire_reduced(sd, sizeof(data), r, NULL));
+  r->fields[field].n_decimated = r->fields[field].decimated_size = 0;
+
+  sd_reducer_free(r);
+  sd_close(sd);
+  sd_destroy(sd);
+  close(master);
+
+  return test_result();
+}
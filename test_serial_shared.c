@@ -0,0 +1,124 @@
+/*
+ * Exercises the shared handle registry and what close leaves behind
+ * on the port, against pseudo terminals.
+ * Build and run with `make test` after `ruby extconf.rb`.
+ */
+#include "test_serial.h"
+#include <termios.h>
+#include <pthread.h>
+
+#define RACERS 8
+#define RACES 50
+
+static char *race_path;
+static SERIAL_DEVICE raced[RACERS];
+
+static void *race_open(void *arg)
+{
+  int err;
+  raced[(long)arg] = sd_open_shared(race_path, B57600, 8, 1, SERIAL_DEVICE_PARITY_NONE, 0, &err);
+  return NULL;
+}
+
+/**
+ * True if the port is set up the way sd_init leaves it at speed
+ */
+static int configured(int fd, speed_t speed)
+{
+  struct termios tio;
+  tcgetattr(fd, &tio);
+  return speed == cfgetospeed(&tio) && 0 == (tio.c_lflag & ICANON);
+}
+
+int main(int argc, char **argv) {
+
+  SERIAL_DEVICE sd, again;
+  pthread_t threads[RACERS];
+  struct termios original;
+  char link[64];
+  int master, watch, err, race;
+  long i;
+
+  master = test_open_master();
+  if (0 > master) {
+    printf("No pseudo terminal available\n");
+    return 1;
+  }
+  /* Holds the slave open between devices and reports its settings */
+  watch = open(ptsname(master), O_RDWR | O_NOCTTY);
+  tcgetattr(watch, &original);
+  CHECK(!configured(watch, B57600));
+
+  /* Sharing: same settings, or a symlink to the same node, get the same handle */
+  sd = sd_open_shared(ptsname(master), B57600, 8, 1, SERIAL_DEVICE_PARITY_NONE, 0, &err);
+  CHECK(NULL != sd && SERIAL_DEVICE_OK == err);
+  if (NULL == sd) {
+    return 1;
+  }
+  CHECK(configured(watch, B57600));
+  snprintf(link, sizeof(link), "/tmp/test_serial_shared.%d", (int)getpid());
+  CHECK(0 == symlink(ptsname(master), link));
+  again = sd_open_shared(link, B57600, 8, 1, SERIAL_DEVICE_PARITY_NONE, 0, &err);
+  unlink(link);
+  CHECK(sd == again);
+  CHECK(2 == sd->refcount);
+
+  /* Different settings raise rather than reconfigure under the other holder */
+  CHECK(NULL == sd_open_shared(ptsname(master), B9600, 8, 1, SERIAL_DEVICE_PARITY_NONE, 0, &err));
+  CHECK(SERIAL_DEVICE_ERR_SHARED == err);
+  CHECK(configured(watch, B57600));
+
+  /* Only the last holder closes, and puts the original settings back */
+  CHECK(SERIAL_DEVICE_OK == sd_close(sd));
+  CHECK(0 <= sd->fd);
+  sd_destroy(again);
+  CHECK(1 == sd->refcount);
+  sd_destroy(sd);
+  CHECK(!configured(watch, B57600));
+
+  /*
+    Threads opening at once all end up with the one handle, and no
+    thread that lost the race restores the port under the winner
+  */
+  race_path = ptsname(master);
+  for (race = 0; race < RACES && 0 == failures; race++) {
+    for (i = 0; i < RACERS; i++) {
+      pthread_create(&threads[i], NULL, race_open, (void *)i);
+    }
+    for (i = 0; i < RACERS; i++) {
+      pthread_join(threads[i], NULL);
+    }
+    for (i = 0; i < RACERS; i++) {
+      CHECK(NULL != raced[i] && raced[0] == raced[i]);
+    }
+    CHECK(NULL != raced[0] && RACERS == raced[0]->refcount);
+    CHECK(configured(watch, B57600));
+    for (i = 0; i < RACERS; i++) {
+      sd_destroy(raced[i]);
+    }
+    CHECK(!configured(watch, B57600));
+  }
+
+  /* Without restore the port stays configured for the next open */
+  sd = sd_initWithDevice_baudrate_dataBits_stopBits_parity_flowControl(ptsname(master), B57600, 8, 1, SERIAL_DEVICE_PARITY_NONE, 0);
+  CHECK(NULL != sd);
+  sd_set_restore(sd, 0);
+  sd_destroy(sd);
+  CHECK(configured(watch, B57600));
+
+  /* which then finds nothing to change, and restores to that */
+  sd = sd_initWithDevice_baudrate_dataBits_stopBits_parity_flowControl(ptsname(master), B57600, 8, 1, SERIAL_DEVICE_PARITY_NONE, 0);
+  CHECK(NULL != sd);
+  CHECK(sd->oldtio->c_cflag == sd->tio->c_cflag);
+  CHECK(sd->oldtio->c_iflag == sd->tio->c_iflag);
+  CHECK(sd->oldtio->c_lflag == sd->tio->c_lflag);
+  CHECK(cfgetospeed(sd->oldtio) == cfgetospeed(sd->tio));
+  sd_destroy(sd);
+  CHECK(configured(watch, B57600));
+
+  tcsetattr(watch, TCSANOW, &original);
+  close(watch);
+  close(master);
+
+  return test_result();
+}
@@ -0,0 +1,101 @@
+/*
+ * Checks the chunk stamps from sd_read_stamped and
+ * sd_read_nbytes_stamped against a pseudo terminal.
+ * Build and run with `make test` after `ruby extconf.rb`.
+ */
+#include "test_serial.h"
+#include <pthread.h>
+#include "serial_trace.h"
+
+/* Between the two halves of a response */
+#define GAP_MS 30
+
+static int late_master;
+
+/**
+ * Finish the response after a pause, so it reaches the reader in two chunks
+ */
+static void *write_late(void *arg)
+{
+  usleep(GAP_MS * 1000);
+  write(late_master, "BBBBBB\r\n", 8);
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+
+  SERIAL_DEVICE sd;
+  SD_CHUNK_STAMP stamps[4], stamp, last;
+  pthread_t writer;
+  unsigned long long before, after, char_ns;
+  char data[16];
+  int master, n_stamps, i;
+
+  sd = test_open_device(&master);
+  CHECK(NULL != sd);
+  if (NULL == sd) {
+    return 1;
+  }
+  char_ns = sd_char_time_ns(sd);
+  CHECK(0 < char_ns);
+
+  /* A response split in two gives a stamp per chunk, on the trace clock */
+  late_master = master;
+  before = sd_trace_now();
+  CHECK(4 == write(master, "AAAA", 4));
+  usleep(10000);
+  pthread_create(&writer, NULL, write_late, NULL);
+  CHECK(SERIAL_DEVICE_OK == sd_read_stamped(sd, stamps, 4, &n_stamps));
+  after = sd_trace_now();
+  pthread_join(writer, NULL);
+  CHECK(0 == strcmp("AAAABBBBBB\r", sd->last_response));
+
+  CHECK(2 == n_stamps);
+  if (2 == n_stamps) {
+    CHECK(0 == stamps[0].offset && 4 == stamps[0].length);
+    CHECK(4 == stamps[1].offset && 8 == stamps[1].length);
+    CHECK(0 == stamps[0].queued && 0 == stamps[1].queued);
+    CHECK(before <= stamps[0].ts_ns && stamps[1].ts_ns <= after);
+    CHECK(stamps[0].ts_ns + (GAP_MS - 10) * 1000000ULL <= stamps[1].ts_ns);
+    for (i = 0; i < 2; i++) {
+      CHECK(stamps[i].ts_ns - stamps[i].length * char_ns == stamps[i].first_ns);
+    }
+  }
+
+  /* Chunks past max_stamps are read but not stamped */
+  CHECK(4 == write(master, "AAAA", 4));
+  usleep(10000);
+  pthread_create(&writer, NULL, write_late, NULL);
+  CHECK(SERIAL_DEVICE_OK == sd_read_stamped(sd, stamps, 1, &n_stamps));
+  pthread_join(writer, NULL);
+  CHECK(1 == n_stamps);
+  CHECK(0 == strcmp("AAAABBBBBB\r", sd->last_response));
+
+  /* What a short read leaves behind is counted, and pushes first_ns back */
+  CHECK(10 == write(master, "0123456789", 10));
+  usleep(10000);
+  memset(&last, 0, sizeof(last));
+  for (i = 0; i < 3; i++) {
+    memset(&stamp, 0, sizeof(stamp));
+    CHECK(3 == sd_read_nbytes_stamped(sd, 3, data, &stamp));
+    CHECK(0 == memcmp("0123456789" + 3 * i, data, 3));
+    CHECK(0 == stamp.offset && 3 == stamp.length);
+    CHECK(7 - 3 * i == stamp.queued);
+    CHECK(stamp.ts_ns - (3 + stamp.queued) * char_ns == stamp.first_ns);
+    CHECK(last.ts_ns <= stamp.ts_ns);
+    last = stamp;
+  }
+  CHECK(1 == sd_read_nbytes_stamped(sd, 3, data, &stamp));
+  CHECK(1 == stamp.length && 0 == stamp.queued);
+
+  /* Nothing waiting leaves the stamp alone */
+  memset(&stamp, 0, sizeof(stamp));
+  CHECK(0 == sd_read_nbytes_stamped(sd, 3, data, &stamp));
+  CHECK(0 == stamp.ts_ns && 0 == stamp.length);
+
+  sd_close(sd);
+  sd_destroy(sd);
+  close(master);
+
+  return test_result();
+}
@@ -0,0 +1,67 @@
+#
+# test_serial_stamped.rb
+#
+# Unpacks the stamps from read_bytes_stamped and read_stamped with
+# SerialDevice::STAMP_FORMAT, against a pseudo terminal.
+# Run with `make test` after `ruby extconf.rb`.
+#
+require 'pty'
+require 'io/console'
+require 'RbSerialDevice'
+
+$failures = 0
+
+def check(cond, what)
+  unless cond
+    puts "FAIL #{what}"
+    $failures += 1
+  end
+end
+
+def now_ns
+  Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond)
+end
+
+master, slave = PTY.open
+master.raw!
+sd = SerialDevice.new(:device => slave.path, :baud => 9600)
+char_ns = sd.char_time_ns
+
+check(28 == [0, 0, 0, 0, 0].pack(SerialDevice::STAMP_FORMAT).bytesize, "record size")
+
+# One record for a short read, with what it left behind queued
+before = now_ns
+master.write("0123456789")
+sleep 0.01
+data, stamp = sd.read_bytes_stamped(4)
+check("0123" == data, "read_bytes_stamped data #{data.inspect}")
+check(28 == stamp.bytesize, "read_bytes_stamped stamp is #{stamp.bytesize} bytes")
+ts, first, offset, length, queued = stamp.unpack(SerialDevice::STAMP_FORMAT)
+check(before <= ts && ts <= now_ns, "ts #{ts} is on CLOCK_MONOTONIC")
+check([0, 4, 6] == [offset, length, queued], "offset, length, queued #{[offset, length, queued].inspect}")
+check(ts - (4 + 6) * char_ns == first, "first_ns #{first} is back computed from ts #{ts}")
+data, stamp = sd.read_bytes_stamped(16)
+check("456789" == data && 0 == stamp.unpack(SerialDevice::STAMP_FORMAT)[4], "the rest, nothing queued")
+
+# Nothing waiting gives nil
+check(nil == sd.read_bytes_stamped(4), "read_bytes_stamped with nothing waiting")
+
+# A record per chunk of a response.  read_stamped keeps the GVL, so the
+# second half comes from another process.
+master.write("AAAA")
+sleep 0.01
+writer = fork { sleep 0.03; master.write("BBBBBB\r\n"); exit! }
+response, stamps = sd.read_stamped
+Process.wait(writer)
+check("AAAABBBBBB" == response.strip, "read_stamped response #{response.inspect}")
+check(56 == stamps.bytesize, "read_stamped stamps are #{stamps.bytesize} bytes")
+records = stamps.unpack(SerialDevice::STAMP_FORMAT * (stamps.bytesize / 28)).each_slice(5).to_a
+check([[0, 4], [4, 8]] == records.map {|r| r[2, 2] }, "chunks #{records.map {|r| r[2, 2] }.inspect}")
+check(records[0][0] < records[1][0], "stamps in order")
+
+sd.close
+master.close
+slave.close
+
+puts(0 == $failures ? "OK" : "FAILED")
+exit(0 == $failures ? 0 : 1)
@@ -0,0 +1,233 @@
+/*
+ * Exercises serial_stream.c against a pseudo terminal, no hardware needed.
+ * Build and run with `make test` after `ruby extconf.rb`.
+ */
+#include "test_serial.h"
+#include <termios.h>
+#include "serial_stream.h"
+
+#define CAPACITY 64
+#define TOTAL 256
+#define CHURN_THREADS 4
+#define CHURN_ROUNDS 2000
+
+/** Byte at absolute stream position p */
+static char pattern(unsigned long long p)
+{
+  return (char)(p % 251);
+}
+
+static void count_bytes(const char *data, int n, void *ctx)
+{
+  *(int *)ctx += n;
+}
+
+/**
+ * Wait for the stream to publish total bytes
+ */
+static void wait_for(SD_STREAM st, unsigned long long total)
+{
+  int tries;
+  for (tries = 0; tries < 200; tries++) {
+    pthread_mutex_lock(&st->lock);
+    if (st->head >= total) {
+      pthread_mutex_unlock(&st->lock);
+      return;
+    }
+    pthread_mutex_unlock(&st->lock);
+    usleep(10000);
+  }
+}
+
+static void *churn(void *arg)
+{
+  SD_STREAM st = (SD_STREAM)arg;
+  int i;
+
+  for (i = 0; i < CHURN_ROUNDS; i++) {
+    sd_stream_unsubscribe(sd_stream_subscribe(st, SD_STREAM_POLICY_DROP, NULL, NULL));
+  }
+  return NULL;
+}
+
+/**
+ * Subscribers coming and going on several threads keep the count straight
+ */
+static void test_refcount(SERIAL_DEVICE sd)
+{
+  SD_STREAM st = sd_stream_new(sd, CAPACITY);
+  pthread_t threads[CHURN_THREADS];
+  int i;
+
+  for (i = 0; i < CHURN_THREADS; i++) {
+    pthread_create(&threads[i], NULL, churn, st);
+  }
+  for (i = 0; i < CHURN_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  CHECK(1 == st->refcount);
+  sd_stream_release(st);
+}
+
+/**
+ * A stream whose reader died on a device error can be started again
+ */
+static void test_restart(void)
+{
+  SERIAL_DEVICE sd;
+  SD_STREAM st;
+  SD_SUBSCRIBER sub;
+  char buf[8];
+  int master, slave, dir, tries;
+
+  sd = test_open_device(&master);
+  CHECK(NULL != sd);
+  if (NULL == sd) {
+    return;
+  }
+  st = sd_stream_new(sd, CAPACITY);
+  sub = sd_stream_subscribe(st, SD_STREAM_POLICY_BLOCK, NULL, NULL);
+  CHECK(SERIAL_DEVICE_OK == sd_stream_start(st));
+
+  /* Swap a directory in under the fd so read() fails */
+  dir = open("/", O_RDONLY);
+  dup2(dir, sd->fd);
+  close(dir);
+  close(master);
+  for (tries = 0; tries < 200 && st->running; tries++) {
+    usleep(10000);
+  }
+  CHECK(!st->running);
+  CHECK(SERIAL_DEVICE_ERR_READ == st->err);
+  CHECK(SERIAL_DEVICE_ERR_STOPPED == sd_subscriber_read(sub, buf, sizeof(buf), 0, NULL));
+
+  /* Plug a fresh terminal in under the same fd and start over */
+  master = test_open_master();
+  slave = open(ptsname(master), O_RDWR | O_NOCTTY | O_NONBLOCK);
+  tcsetattr(slave, TCSANOW, sd->tio);
+  dup2(slave, sd->fd);
+  close(slave);
+
+  CHECK(SERIAL_DEVICE_OK == sd_stream_start(st));
+  CHECK(st->running);
+  CHECK(5 == write(master, "again", 5));
+  CHECK(5 == sd_subscriber_read(sub, buf, sizeof(buf), 1000, NULL));
+  CHECK(0 == memcmp("again", buf, 5));
+
+  sd_stream_stop(st);
+  sd_stream_unsubscribe(sub);
+  sd_stream_release(st);
+  sd_close(sd);
+  sd_destroy(sd);
+  close(master);
+}
+
+int main(int argc, char **argv) {
+
+  SERIAL_DEVICE sd;
+  SD_STREAM st, other;
+  SD_SUBSCRIBER block, drop, coalesce, callback;
+  char out[TOTAL], buf[TOTAL];
+  int master, i, n, got, called = 0;
+
+  sd = test_open_device(&master);
+  CHECK(NULL != sd);
+  if (NULL == sd) {
+    return 1;
+  }
+
+  st = sd_stream_new(sd, CAPACITY);
+  block = sd_stream_subscribe(st, SD_STREAM_POLICY_BLOCK, NULL, NULL);
+  drop = sd_stream_subscribe(st, SD_STREAM_POLICY_DROP, NULL, NULL);
+  coalesce = sd_stream_subscribe(st, SD_STREAM_POLICY_COALESCE, NULL, NULL);
+  callback = sd_stream_subscribe(st, SD_STREAM_POLICY_DROP, count_bytes, &called);
+  CHECK(NULL != block && NULL != drop && NULL != coalesce && NULL != callback);
+  CHECK(NULL == sd_stream_subscribe(st, 7, NULL, NULL));
+
+  CHECK(SERIAL_DEVICE_OK == sd_stream_start(st));
+
+  /* A second stream cannot read the same device */
+  other = sd_stream_new(sd, CAPACITY);
+  CHECK(SERIAL_DEVICE_ERR_BUSY == sd_stream_start(other));
+  sd_stream_release(other);
+
+  /* Four rings worth, so the blocking subscriber has to hold the reader back */
+  for (i = 0; i < TOTAL; i++) {
+    out[i] = pattern(i);
+  }
+  CHECK(TOTAL == write(master, out, TOTAL));
+
+  /* :block sees every byte in order */
+  for (n = 0; n < TOTAL; n += got) {
+    got = sd_subscriber_read(block, buf + n, TOTAL - n, 1000, NULL);
+    CHECK(0 < got);
+    if (0 >= got) {
+      break;
+    }
+  }
+  CHECK(TOTAL == n);
+  CHECK(0 == memcmp(out, buf, TOTAL));
+  CHECK(0 == block->dropped);
+  wait_for(st, TOTAL);
+
+  /* :drop lost the oldest bytes and kept the rest in order */
+  n = sd_subscriber_pending(drop);
+  CHECK(0 < n && CAPACITY >= n);
+  CHECK(TOTAL == drop->dropped + n);
+  got = sd_subscriber_read(drop, buf, TOTAL, 0, NULL);
+  CHECK(n == got);
+  for (i = 0; i < got; i++) {
+    CHECK(pattern(drop->dropped + i) == buf[i]);
+  }
+
+  /* :coalesce skips straight to the newest bytes */
+  got = sd_subscriber_read(coalesce, buf, 8, 0, NULL);
+  CHECK(8 == got);
+  CHECK(TOTAL - 8 == coalesce->dropped);
+  CHECK(0 == memcmp(out + TOTAL - 8, buf, 8));
+
+  /* Callbacks see everything without a cursor of their own to drain */
+  CHECK(TOTAL == called);
+  CHECK(0 == sd_subscriber_pending(callback));
+
+  /* Nothing more to read times out rather than reporting the end */
+  CHECK(0 == sd_subscriber_read(block, buf, 1, 20, NULL));
+
+  /* The device cannot be closed out from under the reader */
+  CHECK(SERIAL_DEVICE_ERR_BUSY == sd_close(sd));
+  CHECK(0 <= sd->fd);
+
+  /* Bytes published before stop can still be drained, then the end is reported */
+  CHECK(4 == write(master, "tail", 4));
+  wait_for(st, TOTAL + 4);
+  sd_stream_stop(st);
+  CHECK(!st->running);
+  CHECK(4 == sd_subscriber_read(block, buf, TOTAL, 0, NULL));
+  CHECK(0 == memcmp("tail", buf, 4));
+  CHECK(SERIAL_DEVICE_ERR_STOPPED == sd_subscriber_read(block, buf, TOTAL, 1000, NULL));
+
+  /* Once stopped the device closes, and the stream will not read a dead fd */
+  CHECK(SERIAL_DEVICE_OK == sd_close(sd));
+  CHECK(0 > sd->fd);
+  CHECK(0 > sd_read_nbytes(sd, 1, buf));
+  CHECK(SERIAL_DEVICE_ERR_CLOSED == sd_write(sd, "x"));
+  CHECK(SERIAL_DEVICE_ERR_CLOSED == sd_stream_start(st));
+
+  sd_stream_unsubscribe(block);
+  sd_stream_unsubscribe(drop);
+  sd_stream_unsubscribe(coalesce);
+  sd_stream_unsubscribe(callback);
+  sd_stream_release(st);
+  sd_destroy(sd);
+  close(master);
+
+  sd = test_open_device(&master);
+  CHECK(NULL != sd);
+  test_refcount(sd);
+  sd_destroy(sd);
+  close(master);
+
+  test_restart();
+
+  return test_result();
+}
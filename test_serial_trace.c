@@ -0,0 +1,187 @@
+/*
+ * Records a trace through a pseudo terminal, wraps the ring and parses
+ * the Chrome trace JSON that comes out.
+ * Build and run with `make test` after `ruby extconf.rb`.
+ */
+#include "test_serial.h"
+#include <pthread.h>
+#include <sys/stat.h>
+#include "serial_trace.h"
+
+#define PAIRS 2000
+#define CAPACITY 3001
+#define MAX_LANES 8
+
+static SERIAL_DEVICE traced;
+static char fifo[64];
+static volatile int dumped, recorded;
+
+/**
+ * Check the dump in text and count its events by phase.
+ * Every end must close an earlier begin on its lane, and nothing may be
+ * left open at the end.
+ * @returns the number of events
+ */
+static int parse_dump(char *text, int *begins, int *ends)
+{
+  const char *head = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+  const char *tail = "\n]}\n";
+  int depth[MAX_LANES];
+  char *line, *save;
+  char name[32], phase;
+  int tid, n = 0;
+  double ts;
+
+  *begins = *ends = 0;
+  memset(depth, 0, sizeof(depth));
+  CHECK(0 == strncmp(head, text, strlen(head)));
+  CHECK(strlen(text) > strlen(tail) && 0 == strcmp(tail, text + strlen(text) - strlen(tail)));
+
+  for (line = strtok_r(text, "\n", &save); NULL != line; line = strtok_r(NULL, "\n", &save)) {
+    if (NULL == strstr(line, "\"cat\":\"serial\"")) {
+      continue;
+    }
+    n++;
+    if (4 != sscanf(line, "{\"name\":\"%31[^\"]\",\"cat\":\"serial\",\"ph\":\"%c\",\"pid\":1,\"tid\":%d,\"ts\":%lf",
+		    name, &phase, &tid, &ts)
+	|| 0 > tid || MAX_LANES <= tid) {
+      printf("Bad event %s\n", line);
+      failures++;
+      continue;
+    }
+    if (SD_TRACE_BEGIN == phase) {
+      (*begins)++;
+      depth[tid]++;
+    } else if (SD_TRACE_END == phase) {
+      (*ends)++;
+      CHECK(0 < depth[tid]);
+      depth[tid]--;
+    }
+  }
+  for (tid = 0; tid < MAX_LANES; tid++) {
+    CHECK(0 == depth[tid]);
+  }
+  return n;
+}
+
+/**
+ * Read fd to the end into a string to free
+ */
+static char *slurp_fd(int fd)
+{
+  char *text = NULL;
+  size_t size = 0, length = 0;
+  ssize_t n;
+
+  do {
+    if (length + 4096 + 1 > size) {
+      size = 2 * size + 4096 + 1;
+      text = (char *)realloc(text, size);
+    }
+    n = read(fd, text + length, size - length - 1);
+    length += 0 < n ? n : 0;
+  } while (0 < n);
+  text[length] = '\0';
+  return text;
+}
+
+static void *dump_run(void *arg)
+{
+  dumped = sd_trace_dump(fifo);
+  return NULL;
+}
+
+static void *record_run(void *arg)
+{
+  sd_trace_record(traced, SD_TRACE_FIRST_BYTE, SD_TRACE_INSTANT, NULL, 1, 0);
+  recorded = 1;
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+
+  pthread_t dumper, recorder;
+  char path[64], *text;
+  int master, fd, i, n, begins, ends;
+
+  traced = test_open_device(&master);
+  CHECK(NULL != traced);
+  if (NULL == traced) {
+    return 1;
+  }
+  snprintf(path, sizeof(path), "/tmp/test_serial_trace.%d.json", (int)getpid());
+
+  /*
+    Seven events in a ring of six: the first end loses its begin to the
+    wrap, and the last begin has no end yet.  Both are left out.
+  */
+  CHECK(SERIAL_DEVICE_OK == sd_trace_enable(6));
+  for (i = 0; i < 3; i++) {
+    sd_trace_record(traced, SD_TRACE_WRITE, SD_TRACE_BEGIN, "PING", 4, 0);
+    sd_trace_record(traced, SD_TRACE_WRITE, SD_TRACE_END, NULL, 0, 0);
+  }
+  sd_trace_record(traced, SD_TRACE_WRITE, SD_TRACE_BEGIN, "PING", 4, 0);
+  CHECK(4 == sd_trace_dump(path));
+  fd = open(path, O_RDONLY);
+  text = slurp_fd(fd);
+  close(fd);
+  unlink(path);
+  CHECK(NULL != strstr(text, "\"command\":\"PING\""));
+  CHECK(4 == parse_dump(text, &begins, &ends));
+  CHECK(2 == begins && 2 == ends);
+  free(text);
+
+  /* Real transactions land in the trace too */
+  CHECK(SERIAL_DEVICE_OK == sd_trace_enable(CAPACITY));
+  CHECK(SERIAL_DEVICE_OK == sd_write(traced, "PING"));
+  CHECK(6 == write(master, "PONG\r\n", 6));
+  CHECK(SERIAL_DEVICE_OK == sd_read_timeout(traced, 200, 20));
+  n = sd_trace_dump(path);
+  fd = open(path, O_RDONLY);
+  text = slurp_fd(fd);
+  close(fd);
+  unlink(path);
+  CHECK(NULL != strstr(text, "\"name\":\"write\""));
+  CHECK(NULL != strstr(text, "\"name\":\"first_byte\""));
+  CHECK(n == parse_dump(text, &begins, &ends));
+  CHECK(2 == begins && 2 == ends);
+  free(text);
+
+  /*
+    Enough to wrap an odd sized ring mid pair and to fill a pipe, dumped
+    into a fifo nobody is reading yet so the export stalls part way
+    through.  Recording must not wait for it.
+  */
+  snprintf(fifo, sizeof(fifo), "/tmp/test_serial_trace.%d.fifo", (int)getpid());
+  CHECK(0 == mkfifo(fifo, 0600));
+  for (i = 0; i < PAIRS; i++) {
+    sd_trace_record(traced, SD_TRACE_READ, SD_TRACE_BEGIN, NULL, 0, 0);
+    sd_trace_record(traced, SD_TRACE_READ, SD_TRACE_END, NULL, i, 0);
+  }
+  pthread_create(&dumper, NULL, dump_run, NULL);
+  fd = open(fifo, O_RDONLY);
+  usleep(100000);
+  pthread_create(&recorder, NULL, record_run, NULL);
+  for (i = 0; i < 100 && !recorded; i++) {
+    usleep(10000);
+  }
+  CHECK(recorded);
+  text = slurp_fd(fd);
+  close(fd);
+  pthread_join(dumper, NULL);
+  pthread_join(recorder, NULL);
+  unlink(fifo);
+
+  n = parse_dump(text, &begins, &ends);
+  CHECK(dumped == n);
+  CHECK(CAPACITY - 1 == n);
+  CHECK(begins == ends && (CAPACITY - 1) / 2 == begins);
+  free(text);
+
+  sd_trace_disable();
+  sd_close(traced);
+  sd_destroy(traced);
+  close(master);
+
+  return test_result();
+}